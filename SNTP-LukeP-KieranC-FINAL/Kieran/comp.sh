@@ -0,0 +1,8 @@
+#!/usr/bin/bash
+if gcc -Wall main.c packet.c timesource.c filter.c config.c handoff.c \
+       upstream.c sketch.c ../Luke/sntp_client.c -o server -lpthread -lm &&
+   gcc -Wall shmclock.c timesource.c -o shmclock -lm; then
+    echo "Holy Shit it worked"
+else
+    echo "Ahhh, close but no cigar"
+fi
@@ -0,0 +1,170 @@
+/********************************************************************************
+Program Name: SNTP Server - configuration file
+Description:
+Reads the reloadable settings described in config.h.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define CONFIGLINE 512
+
+/********************************************************************************
+CONFIG_DEFAULTS
+Arguments: struct server_config *cfg: filled with the built in defaults
+Returns: N/A
+********************************************************************************/
+void config_defaults(struct server_config *cfg){
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->broadcast_interval = BROADCASTINTERVAL;
+  cfg->verbose = 1;
+  cfg->upstream_poll = UPSTREAMPOLL;
+  cfg->stats_interval = STATSINTERVAL;
+}
+
+/********************************************************************************
+CONFIG_ADD_UPSTREAM
+Arguments: struct server_config *cfg: settings to add to
+           const char *host: upstream server
+           const char *port: its port, NULL for UPSTREAMPORT
+Returns: error handle, 1 if the list is full
+********************************************************************************/
+int config_add_upstream(struct server_config *cfg, const char *host,
+			const char *port){
+  struct upstream_server *up;
+
+  if (cfg->nupstream == UPSTREAMMAX){
+    return 1;
+  }
+  up = &cfg->upstream[cfg->nupstream++];
+  snprintf(up->host, sizeof(up->host), "%s", host);
+  snprintf(up->port, sizeof(up->port), "%s", port ? port : UPSTREAMPORT);
+  return 0;
+}
+
+/********************************************************************************
+CONFIG_UPSTREAM_CHANGED
+Arguments: const struct server_config *a, *b: settings to compare
+Returns: 1 if the upstream servers or poll interval differ
+********************************************************************************/
+int config_upstream_changed(const struct server_config *a,
+			    const struct server_config *b){
+  int i;
+
+  if (a->nupstream != b->nupstream || a->upstream_poll != b->upstream_poll){
+    return 1;
+  }
+  for (i = 0; i < a->nupstream; i++){
+    if (strcmp(a->upstream[i].host, b->upstream[i].host) != 0 ||
+	strcmp(a->upstream[i].port, b->upstream[i].port) != 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/********************************************************************************
+SET_STRING
+Copies a value into a setting, "none" clears it
+
+Arguments: char *dest: setting, CONFIGSTRING bytes
+           const char *value: value from the file
+Returns: N/A
+********************************************************************************/
+static void set_string(char *dest, const char *value){
+  if (strcmp(value, "none") == 0){
+    dest[0] = '\0';
+  } else{
+    snprintf(dest, CONFIGSTRING, "%s", value);
+  }
+}
+
+/********************************************************************************
+CONFIG_LOAD
+Reads a configuration file over the settings already in cfg. Nothing is
+changed unless the whole file is valid, so a bad edit followed by SIGHUP
+leaves the running settings alone.
+
+Arguments: const char *path: file to read
+           struct server_config *cfg: settings to update
+Returns: error handle
+********************************************************************************/
+int config_load(const char *path, struct server_config *cfg){
+  FILE *fp;
+  char line[CONFIGLINE], key[CONFIGLINE], value[CONFIGLINE];
+  char extra[CONFIGLINE];
+  struct server_config next = *cfg;
+  int lineno = 0, fields, err = 0, upstreams = 0;
+
+  if ((fp = fopen(path, "r")) == NULL){
+    perror("config: fopen");
+    return 1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL){
+    lineno++;
+    line[strcspn(line, "#\r\n")] = '\0'; //strip comments
+    fields = sscanf(line, "%511s %511s %511s", key, value, extra);
+    if (fields <= 0){
+      continue; //blank line
+    }
+    if (fields == 1){
+      fprintf(stderr, "config: %s:%d: missing value\n", path, lineno);
+      err = 1;
+    } else if (strcmp(key, "upstream") == 0){
+      if (!upstreams++){
+	next.nupstream = 0; //the file's list replaces the old one
+      }
+      if (strcmp(value, "none") != 0 &&
+	  config_add_upstream(&next, value, fields == 3 ? extra : NULL) != 0){
+	fprintf(stderr, "config: %s:%d: more than %d upstream servers\n",
+		path, lineno, UPSTREAMMAX);
+	err = 1;
+      }
+    } else if (fields == 3){
+      fprintf(stderr, "config: %s:%d: too many values\n", path, lineno);
+      err = 1;
+    } else if (strcmp(key, "shm") == 0){
+      set_string(next.shm_name, value);
+    } else if (strcmp(key, "broadcast") == 0){
+      set_string(next.broadcast, value);
+    } else if (strcmp(key, "interval") == 0){
+      if ((next.broadcast_interval = atoi(value)) <= 0){
+	fprintf(stderr, "config: %s:%d: interval must be positive\n",
+		path, lineno);
+	err = 1;
+      }
+    } else if (strcmp(key, "verbose") == 0){
+      next.verbose = atoi(value);
+    } else if (strcmp(key, "stats") == 0){
+      if ((next.stats_interval = atoi(value)) < 0){
+	fprintf(stderr, "config: %s:%d: stats must not be negative\n",
+		path, lineno);
+	err = 1;
+      }
+    } else if (strcmp(key, "upstream_poll") == 0){
+      if ((next.upstream_poll = atoi(value)) <= 0){
+	fprintf(stderr, "config: %s:%d: upstream_poll must be positive\n",
+		path, lineno);
+	err = 1;
+      }
+    } else{
+      fprintf(stderr, "config: %s:%d: unknown setting %s\n",
+	      path, lineno, key);
+      err = 1;
+    }
+  }
+  fclose(fp);
+  if (!err){
+    *cfg = next;
+  }
+  return err;
+}
@@ -0,0 +1,53 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/********************************************************************************
+SERVER CONFIGURATION
+Settings that can change while the server runs. They start from the command
+line, are overridden by the -c file, and the file is read again on SIGHUP.
+The listening port is not here: changing it would mean rebinding.
+
+File format, one setting per line, # starts a comment:
+   shm /sntp_clock      time source page ("none" for the system clock)
+   broadcast 224.0.1.1  broadcast/multicast address ("none" to stop)
+   interval 64          broadcast interval in seconds
+   verbose 1            print every request (0 for quiet)
+   upstream host [port] server to synchronise with, one line each, up to
+                        UPSTREAMMAX ("none" for the local clock at stratum 1)
+   upstream_poll 64     seconds between upstream polls
+   stats 600            seconds between client reports (0 for none)
+Upstream lines in the file replace any given on the command line.
+********************************************************************************/
+
+#define CONFIGSTRING 256
+#define BROADCASTINTERVAL 64 //seconds between broadcast packets
+#define CONFIGPORT 16
+#define UPSTREAMMAX 8 //upstream servers
+#define UPSTREAMPORT "123"
+#define UPSTREAMPOLL 64 //seconds between upstream polls
+#define STATSINTERVAL 600 //seconds between client reports
+
+struct upstream_server{
+  char host[CONFIGSTRING];
+  char port[CONFIGPORT];
+};
+
+struct server_config{
+  char shm_name[CONFIGSTRING];  //"" for the system clock
+  char broadcast[CONFIGSTRING]; //"" for no broadcasts
+  int broadcast_interval;
+  int verbose;
+  struct upstream_server upstream[UPSTREAMMAX];
+  int nupstream;                //0 to serve the local clock at stratum 1
+  int upstream_poll;
+  int stats_interval;           //0 for no periodic client reports
+};
+
+void config_defaults(struct server_config *cfg);
+int config_load(const char *path, struct server_config *cfg);
+int config_add_upstream(struct server_config *cfg, const char *host,
+			const char *port);
+int config_upstream_changed(const struct server_config *a,
+			    const struct server_config *b);
+
+#endif
@@ -0,0 +1,136 @@
+/********************************************************************************
+Program Name: SNTP Server - request filtering
+Description:
+Keeps malformed and non client packets away from the fork in main(). The
+kernel filter sees the UDP header at offset 0, so the SNTP header byte is
+at offset 8 and the length includes the 8 header bytes.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "filter.h"
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#endif
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define UDPHEADER 8 //bytes before the payload in the filter's view
+
+static const char *reject_names[REJECT_REASONS] = {
+  "accepted", "short", "mode", "version"
+};
+
+/********************************************************************************
+FILTER_ATTACH
+Attaches the request filter to the listening socket. Accepts a datagram only
+if it is at least REQUESTLENGTH bytes, mode CLIENTMODE and a version between
+MINVERSION and MAXVERSION.
+
+Arguments: int sockfd: listening socket
+           struct filter_stats *stats: records whether the filter is active
+Returns: 0 if attached, 1 if only user space validation is available
+********************************************************************************/
+int filter_attach(int sockfd, struct filter_stats *stats){
+#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, UDPHEADER + REQUESTLENGTH, 0, 9),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UDPHEADER),          //LI VN mode
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x07),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CLIENTMODE, 0, 6),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UDPHEADER),
+    BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 3),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x07),               //VN
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, MINVERSION, 0, 2),
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, MAXVERSION, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),                   //accept
+    BPF_STMT(BPF_RET | BPF_K, 0),                            //drop
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER,
+		 &prog, sizeof(prog)) == 0){
+    stats->kernel_filter = 1;
+    return 0;
+  }
+  perror("listener: SO_ATTACH_FILTER");
+#endif
+  stats->kernel_filter = 0;
+  return 1;
+}
+
+/********************************************************************************
+PACKET_VALIDATE
+User space version of the kernel filter, applied to every datagram before
+the server forks for it
+
+Arguments: const unsigned char *buffer: raw data from socket
+           int numbytes: length received
+           struct filter_stats *stats: counters to update
+Returns: VALID_REQUEST or the REJECT_* reason
+********************************************************************************/
+int packet_validate(const unsigned char *buffer, int numbytes,
+		    struct filter_stats *stats){
+  int reason = VALID_REQUEST;
+  int version;
+
+  if (numbytes < REQUESTLENGTH){
+    reason = REJECT_SHORT;
+  } else if ((buffer[0] & 0x07) != CLIENTMODE){
+    reason = REJECT_MODE;
+  } else{
+    version = (buffer[0] >> 3) & 0x07;
+    if (version < MINVERSION || version > MAXVERSION){
+      reason = REJECT_VERSION;
+    }
+  }
+  if (reason == VALID_REQUEST){
+    stats->accepted++;
+  } else{
+    stats->rejected[reason]++;
+  }
+  return reason;
+}
+
+/********************************************************************************
+FILTER_REPORT
+Prints the counters. The kernel does not say why the filter dropped a
+packet, so the kernel count is the socket's total drop count (filter drops
+plus receive queue overflows) and the reasons are from user space only.
+
+Arguments: int sockfd: listening socket
+           const struct filter_stats *stats: counters to print
+Returns: N/A
+********************************************************************************/
+void filter_report(int sockfd, const struct filter_stats *stats){
+  int i;
+
+  printf("filter: %lu accepted", stats->accepted);
+  for (i = 1; i < REJECT_REASONS; i++){
+    printf(", %lu %s", stats->rejected[i], reject_names[i]);
+  }
+#if defined(__linux__) && defined(SO_MEMINFO)
+  {
+    unsigned int meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    memset(meminfo, 0, sizeof(meminfo));
+    if (stats->kernel_filter &&
+	getsockopt(sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0){
+      printf(", %u dropped in kernel", meminfo[SK_MEMINFO_DROPS]);
+    }
+  }
+#endif
+  printf("\n");
+  fflush(stdout);
+}
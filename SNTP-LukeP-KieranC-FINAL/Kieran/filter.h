@@ -0,0 +1,34 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/********************************************************************************
+REQUEST FILTERING
+A classic BPF program attached to the listening socket drops anything that
+is not a well formed client request before it is queued, so junk never
+wakes the server. packet_validate() applies the same rules in user space,
+for kernels without socket filters and as a guard before a child is forked.
+********************************************************************************/
+
+#define REQUESTLENGTH 48 //minimum size of a request
+#define MINVERSION 1     //oldest NTP version answered
+#define MAXVERSION 4     //newest NTP version answered
+#define CLIENTMODE 3     //mode of a client request
+
+#define VALID_REQUEST 0
+#define REJECT_SHORT 1   //shorter than REQUESTLENGTH
+#define REJECT_MODE 2    //not a client request
+#define REJECT_VERSION 3 //version outside MINVERSION-MAXVERSION
+#define REJECT_REASONS 4
+
+struct filter_stats{
+  unsigned long accepted;
+  unsigned long rejected[REJECT_REASONS]; //indexed by REJECT_*
+  int kernel_filter; //1 if the BPF program is attached
+};
+
+int filter_attach(int sockfd, struct filter_stats *stats);
+int packet_validate(const unsigned char *buffer, int numbytes,
+		    struct filter_stats *stats);
+void filter_report(int sockfd, const struct filter_stats *stats);
+
+#endif
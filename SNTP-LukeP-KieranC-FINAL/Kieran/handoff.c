@@ -0,0 +1,339 @@
+/********************************************************************************
+Program Name: SNTP Server - socket handoff
+Description:
+Passes bound sockets from a running server to its replacement over a Unix
+domain socket. See handoff.h for the sequence.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+#include "handoff.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define HANDOFFACK 'A' //sent by the new server once it owns the sockets
+
+/********************************************************************************
+UNIX_ADDRESS
+Arguments: const char *path: control socket path
+           struct sockaddr_un *addr: filled in
+Returns: error handle
+********************************************************************************/
+static int unix_address(const char *path, struct sockaddr_un *addr){
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)){
+    fprintf(stderr, "handoff: %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/********************************************************************************
+READ_BYTE
+Reads one byte, waiting no longer than timeout_ms in all, signals or not
+
+Arguments: int fd: connected control socket
+           char *c: where to store the byte
+           int timeout_ms: longest wait
+Returns: 1 for a byte, 0 at end of file, -1 on error or timeout
+********************************************************************************/
+static int read_byte(int fd, char *c, int timeout_ms){
+  struct pollfd pfd;
+  struct timespec now, end;
+  ssize_t n;
+  int left;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += timeout_ms / 1000;
+  end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (end.tv_nsec >= 1000000000L){
+    end.tv_sec++;
+    end.tv_nsec -= 1000000000L;
+  }
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (1){
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (end.tv_sec - now.tv_sec) * 1000 +
+      (end.tv_nsec - now.tv_nsec) / 1000000;
+    if (left <= 0){
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (poll(&pfd, 1, left) == -1){
+      if (errno == EINTR){
+	continue;
+      }
+      return -1;
+    }
+    if (pfd.revents == 0){
+      continue; //timed out, caught at the top
+    }
+    if ((n = read(fd, c, 1)) >= 0){
+      return n;
+    }
+    if (errno != EINTR && errno != EAGAIN){
+      return -1;
+    }
+  }
+}
+
+/********************************************************************************
+CLOSE_RECEIVED
+Closes every descriptor carried by SCM_RIGHTS in a received message, for a
+handoff that is given up after recvmsg has installed them
+
+Arguments: struct msghdr *msg: message from recvmsg
+Returns: N/A
+********************************************************************************/
+static void close_received(struct msghdr *msg){
+  struct cmsghdr *cmsg;
+  int i, fd;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)){
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+      continue;
+    }
+    for (i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++){
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      close(fd);
+    }
+  }
+}
+
+/********************************************************************************
+HANDOFF_RECEIVE
+Asks a running server for its sockets. The connection is left open; the
+caller passes it to handoff_acknowledge once it is ready to serve.
+
+Arguments: const char *path: control socket path
+           int *fds: where to store the received sockets, then the
+                     connection to acknowledge on as the last entry
+           int maxfds: space in fds
+Returns: number of sockets received, 0 if no server is running, -1 on error
+********************************************************************************/
+int handoff_receive(const char *path, int *fds, int maxfds){
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union{
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFFMAXFDS)];
+  } control;
+  int connfd, count;
+  unsigned char nfds;
+
+  if (unix_address(path, &addr) != 0){
+    return -1;
+  }
+  if ((connfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+    perror("handoff: socket");
+    return -1;
+  }
+  if (connect(connfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+    close(connfd);
+    if (errno == ENOENT || errno == ECONNREFUSED){
+      return 0; //nobody to take over from
+    }
+    perror("handoff: connect");
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &nfds;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  if (recvmsg(connfd, &msg, 0) != 1){
+    perror("handoff: recvmsg");
+    close(connfd);
+    return -1;
+  }
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS){
+    fprintf(stderr, "handoff: no sockets received\n");
+    close_received(&msg);
+    close(connfd);
+    return -1;
+  }
+  count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  if (count != nfds || count + 1 > maxfds){
+    fprintf(stderr, "handoff: expected %d sockets, got %d\n", nfds, count);
+    close_received(&msg);
+    close(connfd);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+  fds[count] = connfd;
+  return count;
+}
+
+/********************************************************************************
+HANDOFF_ACKNOWLEDGE
+Tells the old server the new one is serving, so it can drain and exit
+
+Arguments: int connfd: connection from handoff_receive
+Returns: error handle, 1 if the old server gave up waiting and is still
+         serving
+********************************************************************************/
+int handoff_acknowledge(int connfd){
+  char ack = HANDOFFACK;
+  int err = 0, n;
+
+  if (send(connfd, &ack, 1, MSG_NOSIGNAL) != 1){
+    perror("handoff: acknowledge");
+    err = 1;
+  } else{
+    //the old server removes its control socket, then closes this
+    //connection: after that handoff_listen can take the path
+    do{
+      n = read_byte(connfd, &ack, HANDOFFTIMEOUT);
+    } while (n > 0);
+    if (n < 0){
+      fprintf(stderr, "handoff: running server did not close the connection\n");
+    }
+  }
+  close(connfd);
+  return err;
+}
+
+/********************************************************************************
+HANDOFF_LISTEN
+Creates the control socket a future server will connect to. A stale socket
+left by a previous server (which has already handed off, or crashed) is
+replaced; anything else at the path, or a socket another server still
+answers on, is left alone and handoff is not enabled.
+
+Arguments: const char *path: control socket path
+Returns: listening socket, or -1 on error
+********************************************************************************/
+int handoff_listen(const char *path){
+  struct sockaddr_un addr;
+  struct stat st;
+  int ctlfd;
+
+  if (unix_address(path, &addr) != 0){
+    return -1;
+  }
+  if ((ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+    perror("handoff: socket");
+    return -1;
+  }
+  if (lstat(path, &st) == 0){
+    if (!S_ISSOCK(st.st_mode)){
+      fprintf(stderr, "handoff: %s exists and is not a socket\n", path);
+      close(ctlfd);
+      return -1;
+    }
+    if (connect(ctlfd, (struct sockaddr *)&addr, sizeof(addr)) == 0){
+      fprintf(stderr, "handoff: another server is listening on %s\n", path);
+      close(ctlfd);
+      return -1;
+    }
+    if (errno != ECONNREFUSED){
+      perror("handoff: connect");
+      close(ctlfd);
+      return -1;
+    }
+    unlink(path); //stale: nobody is listening
+  }
+  if (bind(ctlfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(ctlfd, 1) == -1){
+    perror("handoff: bind");
+    close(ctlfd);
+    return -1;
+  }
+  return ctlfd;
+}
+
+/********************************************************************************
+HANDOFF_SEND
+Accepts a connection from a new server and gives it the sockets
+
+Arguments: int ctlfd: listening control socket, closed once the new server
+                      has acknowledged
+           const int *fds: sockets to pass
+           int nfds: number of sockets
+Returns: 0 once the new server has acknowledged, 1 if the handoff failed
+         and this server should carry on serving
+********************************************************************************/
+int handoff_send(int ctlfd, const int *fds, int nfds){
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union{
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFFMAXFDS)];
+  } control;
+  struct sockaddr_un addr;
+  socklen_t addr_len;
+  int connfd, n;
+  unsigned char count = nfds;
+  char ack;
+
+  if (nfds > HANDOFFMAXFDS){
+    return 1;
+  }
+  if ((connfd = accept(ctlfd, NULL, NULL)) == -1){
+    perror("handoff: accept");
+    return 1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = &count;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+  if (sendmsg(connfd, &msg, 0) != 1){
+    perror("handoff: sendmsg");
+    close(connfd);
+    return 1;
+  }
+  //the new server may still fail to start; keep serving until it says so,
+  //and don't stop serving for longer than HANDOFFTIMEOUT while it decides
+  if ((n = read_byte(connfd, &ack, HANDOFFTIMEOUT)) != 1 || ack != HANDOFFACK){
+    fprintf(stderr, "handoff: new server did not take over%s\n",
+	    n == -1 && errno == ETIMEDOUT ? " in time" : "");
+    close(connfd);
+    return 1;
+  }
+  //the path is the new server's now: remove it before connfd closes, since
+  //forked children may still hold a copy of ctlfd
+  addr_len = sizeof(addr);
+  if (getsockname(ctlfd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+      addr.sun_path[0]){
+    unlink(addr.sun_path);
+  }
+  close(ctlfd);
+  close(connfd);
+  return 0;
+}
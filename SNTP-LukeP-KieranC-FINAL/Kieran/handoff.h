@@ -0,0 +1,24 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/********************************************************************************
+SOCKET HANDOFF
+Lets a new server process take over the bound sockets of a running one, so
+a restart never leaves the port closed. The running server listens on a
+Unix control socket. A new server started with the same -u path connects to
+it, receives the sockets with SCM_RIGHTS, and acknowledges. The old server
+then stops reading, waits for its children to finish and exits, while the
+new one carries on from the same kernel receive queue. An old server that
+hears nothing back within HANDOFFTIMEOUT keeps serving, and a new server
+whose acknowledgement comes too late exits.
+********************************************************************************/
+
+#define HANDOFFMAXFDS 8     //sockets passed in one handoff
+#define HANDOFFTIMEOUT 5000 //ms the old server waits for the new one
+
+int handoff_receive(const char *path, int *fds, int maxfds);
+int handoff_acknowledge(int connfd);
+int handoff_listen(const char *path);
+int handoff_send(int ctlfd, const int *fds, int nfds);
+
+#endif
@@ -19,6 +19,44 @@ Version 1.00: 2/12/2015
 Version 1.01: 3/12/2015
    Typos.
 
+Version 1.02:
+   Timestamps come from a pluggable time source (timesource.c). -s reads
+   them from a shared memory page kept up to date by shmclock.
+
+Version 1.03:
+   Broadcast mode. -b sends mode 5 packets to a broadcast or multicast
+   address every -i seconds alongside normal unicast service.
+
+Version 1.04:
+   Requests are filtered before forking: a BPF socket filter drops short,
+   non client and unsupported version packets in the kernel, and
+   packet_validate() checks again in user space. SIGUSR1 prints the
+   counters.
+
+Version 1.05:
+   Zero downtime restarts. With -u the server listens on a Unix control
+   socket; a new server started with the same -u path takes over the bound
+   socket (handoff.c) and the old one drains its children and exits.
+   -c names a configuration file (config.h) that is read again on SIGHUP.
+
+Version 1.06:
+   Stratum 2 operation. -U (or upstream lines in the config file) names
+   servers that a background thread polls (upstream.c). Replies carry the
+   stratum, reference id, root delay and dispersion, reference time and
+   leap indicator worked out from them, instead of a fixed stratum 1.
+
+Version 1.07:
+   Client statistics. The receive loop feeds every source address into
+   fixed size sketches (sketch.c) that estimate the number of distinct
+   clients and the top talkers. They are printed every "stats" seconds
+   (config file) and on SIGUSR1.
+
+Version 1.08:
+   Reply building (header_constructor, packet_constructor,
+   broadcast_constructor, local_time_finder) moved to packet.c so the
+   simulator in ../Sim can link it, and time sources gained a hook so it
+   can supply a virtual clock.
+
 Description:
 The program runs in a shell and binds to a socket. It then waits for incoming
 traffic on the port designated by PORTNO. On receiving a packet, the program
@@ -26,6 +64,20 @@ forks and constructs an SNTP response packet before transmitting it to the
 sender of the original packet. The child process is then destroyed. During this 
 time the parent process continues listening for further requests and creating 
 further children to deal with them.
+
+Usage: ./server [-s shm_name] [-b address [-i seconds]] [-U server]...
+                [-c config] [-u path]
+   -s  take timestamps from the shmclock page shm_name (e.g. /sntp_clock)
+       instead of reading the system clock per packet
+   -b  also send broadcast (mode 5) packets to address on PORTNO, which may
+       be a broadcast address or an IPv4/IPv6 multicast group
+   -i  broadcast interval in seconds (default BROADCASTINTERVAL)
+   -U  upstream server to synchronise with on port 123, may be repeated.
+       Without one the server is stratum 1 off the local clock.
+   -c  configuration file, overrides the options above and is reloaded
+       on SIGHUP
+   -u  control socket path for handing the listening socket over to a
+       new server. Start the new build with the same -u to upgrade.
 ********************************************************************************/
 
 /********************************************************************************
@@ -43,29 +95,49 @@ INCLUDES
 #include <netdb.h>
 #include <time.h>
 #include "structure.h"
+#include "timesource.h"
+#include "filter.h"
+#include "config.h"
+#include "handoff.h"
+#include "upstream.h"
+#include "sketch.h"
+#include "packet.h"
 #include <signal.h>
+#include <poll.h>
 #include <sys/wait.h>
-#include <sys/time.h>
 
 /********************************************************************************
 DEFINITIONS
 ********************************************************************************/
 
 #define MAXIMUMBUFFER 48 //size of packet
-#define EPOCH 2208988800U //Linux epoc (1900-1970)
-#define NTPFRACTIONCONSTANT 4294967295.0  //number of fraction states in second
 #define PORTNO "9100" //port to listen on
+#define MULTICASTTTL 1 //hops a multicast packet may travel
+
+static volatile sig_atomic_t report_requested = 0; //set by SIGUSR1
+static volatile sig_atomic_t reload_requested = 0; //set by SIGHUP
 
 void *get_in_addr(struct sockaddr *sa);
 void sigchld_handler( int s);
+void sigusr1_handler( int s);
+void sighup_handler( int s);
 void signal_handler(void);
-void packet_constructor(union Packetmagic *Sent,
-			union Packetmagic *Received, unsigned char *buffer);
-void local_time_finder(union Packetmagic *Sent, int *state);
 void ip_finder(struct sockaddr_storage their_addr, char *address_array);
 int sender(int *sockfd, union Packetmagic *Sent,
 	   struct sockaddr_storage their_addr,
 	   socklen_t addr_len, int *numbytes);
+int broadcast_initializer(const char *address, int *bcastfd,
+			  struct sockaddr_storage *group, socklen_t *group_len);
+void broadcaster(int bcastfd, struct sockaddr_storage group,
+		 socklen_t group_len, int interval);
+pid_t broadcast_start(const struct server_config *cfg, int sockfd);
+void config_apply(struct server_config *current,
+		  const struct server_config *next,
+		  pid_t *bcast_pid, int sockfd);
+void drain_and_exit(int sockfd, pid_t bcast_pid);
+long long monotonic_ms(void);
+void client_report(struct client_sketch *recent, struct client_sketch *total,
+		   struct client_sketch *scratch, int interval);
 
 /********************************************************************************
  *GET_IN_ADDR
@@ -91,8 +163,31 @@ void sigchld_handler( int s){
   while( wait( NULL) > 0);
 }
 /********************************************************************************
+SIGUSR1_HANDLER
+Asks the main loop to print the filter counters, upstream state and
+client statistics
+
+Arguments: N/A
+Returns: N/A
+********************************************************************************/
+void sigusr1_handler( int s){
+  report_requested = 1;
+}
+/********************************************************************************
+SIGHUP_HANDLER
+Asks the main loop to reload the configuration file
+
+Arguments: N/A
+Returns: N/A
+********************************************************************************/
+void sighup_handler( int s){
+  reload_requested = 1;
+}
+/********************************************************************************
 SIGNAL_HANDLER
-After child processes end, this cleans up the zombie processes
+After child processes end, this cleans up the zombie processes. Also
+installs the SIGUSR1 and SIGHUP handlers, without SA_RESTART so that they
+interrupt poll and the main loop acts on them straight away.
 
 Arguments: N/A
 Returns: N/A
@@ -106,73 +201,19 @@ void signal_handler(){
     perror( "Server sigaction");
     exit( 1);
   }
-  return;
-}
-/********************************************************************************
-PACKET_CONSTRUCTOR
-Fills in various parts of the response packet
-
-Arguments: union Packetmagic *Sent: The response packet architecture
-           union Packetmagic *Received: The request packet architecture
-           unsigned char *buffer: raw data from socket
-Returns: N/A
-********************************************************************************/
-void packet_constructor(union Packetmagic *Sent,
-			union Packetmagic *Received,
-			unsigned char *buffer){
-
-  memcpy(Received->bytes, buffer,
-	 sizeof(Received->bytes));  //transfer buffer to receive packet.
-
-  memcpy(&Sent->packet.header.topline, &Received->packet.header.topline,
-	 sizeof(Received->packet.header.topline)); //transfer topline
-  memset(&Sent->packet.header.topline, 0x24, 1); //set mode to 4
-  memset(&Sent->packet.header.strat, 0x01, 1); //set stratum to 1
-
-  //transfer to originate timestamp
-  memcpy(&Sent->packet.origin.sec,
-	 &Received->packet.transmit.sec,
-	 sizeof(Received->packet.transmit.sec));
-  //transfer to originate timestamp
-  memcpy(&Sent->packet.origin.frac,
-	 &Received->packet.transmit.frac,
-	 sizeof(Received->packet.transmit.frac));
-  return;
-}
-
-/********************************************************************************
-LOCAL_TIME_FINDER
-Fills in response packet timestamps. On first call the receive timestamp
- is filled in, on the second call the transmit timestamp is filled in.
-
-Arguments: union Packetmagic *Sent: The response packet architecture
-           in *state: Tracks whether first call or second call
-Returns: N/A 
-********************************************************************************/
-
-void local_time_finder(union Packetmagic *Sent, int *state){
-  struct timeval servertime;
-  gettimeofday(&servertime, NULL);
-
-  if(*state){
-    Sent->packet.receive.sec = (htonl(servertime.tv_sec + EPOCH)); //create
-    Sent->packet.receive.frac = (htonl((servertime.tv_usec * 1e-6)
-				       * NTPFRACTIONCONSTANT));
-    *state = 0;
-  } else{
-    Sent->packet.transmit.sec = (htonl(servertime.tv_sec + EPOCH)); //create
-    Sent->packet.transmit.frac = (htonl((servertime.tv_usec * 1e-6)
-					* NTPFRACTIONCONSTANT));
-    
-    memcpy(&Sent->packet.ref.sec, &Sent->packet.transmit.sec,
-	   sizeof(Sent->packet.transmit.sec));
-    memcpy(&Sent->packet.ref.frac, &Sent->packet.transmit.frac,
-	   sizeof(Sent->packet.transmit.frac));
-    *state = 1;
+  sa.sa_handler = sigusr1_handler;
+  sa.sa_flags = 0;
+  if( sigaction( SIGUSR1, &sa, NULL) == -1){
+    perror( "Server sigaction");
+    exit( 1);
+  }
+  sa.sa_handler = sighup_handler;
+  if( sigaction( SIGHUP, &sa, NULL) == -1){
+    perror( "Server sigaction");
+    exit( 1);
   }
   return;
 }
-
 /********************************************************************************
 SOCKET_INITIALIZER
 Clears and initializes hints, calls getaddrinfo,
@@ -253,12 +294,244 @@ int sender(int *sockfd, union Packetmagic *Sent,
 			 (struct sockaddr*)&their_addr, addr_len)) == -1){
     perror("Talker: sendto");
     return(1);
+  }
+  return 0;
+}
+/********************************************************************************
+BROADCAST_INITIALIZER
+Resolves the broadcast address and sets up a socket that may send to it
+
+Arguments: const char *address: broadcast address or multicast group
+           int *bcastfd: socket file descriptor
+           struct sockaddr_storage *group: resolved destination
+           socklen_t *group_len: length of destination
+Returns: error handle
+********************************************************************************/
+int broadcast_initializer(const char *address, int *bcastfd,
+			  struct sockaddr_storage *group, socklen_t *group_len){
+  struct addrinfo hints, *result;
+  int on = 1, ttl = MULTICASTTTL;
+  int rv;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((rv = getaddrinfo(address, PORTNO, &hints, &result)) != 0){
+    fprintf(stderr, "broadcast: getaddrinfo: %s\n", gai_strerror(rv));
+    return 1;
+  }
+  if ((*bcastfd = socket(result->ai_family, result->ai_socktype,
+			 result->ai_protocol)) == -1){
+    perror("broadcast: socket");
+    freeaddrinfo(result);
+    return 1;
+  }
+  memcpy(group, result->ai_addr, result->ai_addrlen);
+  *group_len = result->ai_addrlen;
+  freeaddrinfo(result);
+
+  if (group->ss_family == AF_INET6){
+    if (setsockopt(*bcastfd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+		   &ttl, sizeof(ttl)) == -1){
+      perror("broadcast: IPV6_MULTICAST_HOPS");
+    }
   } else{
-    printf("Sent response\n");
+    unsigned char ttl4 = MULTICASTTTL;
+    if (setsockopt(*bcastfd, SOL_SOCKET, SO_BROADCAST,
+		   &on, sizeof(on)) == -1){
+      perror("broadcast: SO_BROADCAST");
+    }
+    if (setsockopt(*bcastfd, IPPROTO_IP, IP_MULTICAST_TTL,
+		   &ttl4, sizeof(ttl4)) == -1){
+      perror("broadcast: IP_MULTICAST_TTL");
+    }
   }
   return 0;
 }
 /********************************************************************************
+BROADCASTER
+Runs in its own child process. Sends a broadcast packet every interval
+seconds, on absolute deadlines so the period does not drift, until the
+parent server goes away.
+
+Arguments: int bcastfd: socket from broadcast_initializer
+           struct sockaddr_storage group: destination
+           socklen_t group_len: length of destination
+           int interval: seconds between packets
+Returns: N/A
+********************************************************************************/
+void broadcaster(int bcastfd, struct sockaddr_storage group,
+		 socklen_t group_len, int interval){
+  union Packetmagic Sent;
+  struct timespec next;
+  unsigned char poll = 0;
+  pid_t parent = getppid();
+
+  while ((1 << (poll + 1)) <= interval){
+    poll++; //log2 of interval
+  }
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (getppid() == parent){
+    broadcast_constructor(&Sent, poll);
+    if (sendto(bcastfd, Sent.bytes, sizeof(Sent.bytes), 0,
+	       (struct sockaddr *)&group, group_len) == -1){
+      perror("broadcast: sendto");
+    }
+    next.tv_sec += interval;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			   &next, NULL) != 0);
+  }
+  exit(0);
+}
+/********************************************************************************
+BROADCAST_START
+Forks a broadcaster for the configured address, if there is one
+
+Arguments: const struct server_config *cfg: current settings
+           int sockfd: listening socket, closed in the broadcaster
+Returns: broadcaster pid, 0 if broadcasting is off, -1 if it failed to start
+********************************************************************************/
+pid_t broadcast_start(const struct server_config *cfg, int sockfd){
+  int bcastfd;
+  struct sockaddr_storage group;
+  socklen_t group_len;
+  pid_t pid;
+
+  if (cfg->broadcast[0] == '\0'){
+    return 0;
+  }
+  if (broadcast_initializer(cfg->broadcast, &bcastfd,
+			    &group, &group_len) != 0){
+    return -1;
+  }
+  if ((pid = fork()) == 0){
+    close(sockfd);
+    broadcaster(bcastfd, group, group_len, cfg->broadcast_interval);
+  }
+  close(bcastfd);
+  if (pid == -1){
+    perror("broadcast: fork");
+    return -1;
+  }
+  printf("broadcast: sending to %s every %d seconds\n",
+	 cfg->broadcast, cfg->broadcast_interval);
+  return pid;
+}
+/********************************************************************************
+CONFIG_APPLY
+Switches the running server over to new settings. Only the parts that
+changed are touched; the listening socket never is.
+
+Arguments: struct server_config *current: settings in use, updated
+           const struct server_config *next: settings to move to
+           pid_t *bcast_pid: running broadcaster, replaced if it changes
+           int sockfd: listening socket
+Returns: N/A
+********************************************************************************/
+void config_apply(struct server_config *current,
+		  const struct server_config *next,
+		  pid_t *bcast_pid, int sockfd){
+  char shm_name[CONFIGSTRING], broadcast[CONFIGSTRING];
+  int broadcast_interval = next->broadcast_interval;
+  pid_t pid;
+
+  snprintf(shm_name, sizeof(shm_name), "%s", next->shm_name);
+  snprintf(broadcast, sizeof(broadcast), "%s", next->broadcast);
+  if (strcmp(current->shm_name, next->shm_name) != 0){
+    if (time_source_init(next->shm_name[0] ? TS_SHM : TS_SYSTEM,
+			 next->shm_name) != 0){
+      fprintf(stderr, "config: keeping previous time source\n");
+      snprintf(shm_name, sizeof(shm_name), "%s", current->shm_name);
+    }
+  }
+  if (strcmp(current->broadcast, next->broadcast) != 0 ||
+      current->broadcast_interval != next->broadcast_interval){
+    //the new broadcaster starts first, so a bad address changes nothing
+    if ((pid = broadcast_start(next, sockfd)) == -1){
+      fprintf(stderr, "config: keeping previous broadcast settings\n");
+      snprintf(broadcast, sizeof(broadcast), "%s", current->broadcast);
+      broadcast_interval = current->broadcast_interval;
+    } else{
+      if (*bcast_pid > 0){
+	kill(*bcast_pid, SIGTERM);
+      }
+      *bcast_pid = pid;
+    }
+  }
+  if (config_upstream_changed(current, next)){
+    upstream_configure(next);
+  }
+  *current = *next;
+  //a failed switch is retried on the next reload
+  snprintf(current->shm_name, sizeof(current->shm_name), "%s", shm_name);
+  snprintf(current->broadcast, sizeof(current->broadcast), "%s", broadcast);
+  current->broadcast_interval = broadcast_interval;
+  return;
+}
+/********************************************************************************
+DRAIN_AND_EXIT
+Called once a new server has taken the listening socket. Stops the
+broadcaster, waits for every child still answering a request, then exits.
+
+Arguments: int sockfd: listening socket (the new server has its own copy)
+           pid_t bcast_pid: broadcaster, 0 if none
+Returns: does not return
+********************************************************************************/
+void drain_and_exit(int sockfd, pid_t bcast_pid){
+  struct sigaction sa;
+
+  close(sockfd);
+  if (bcast_pid > 0){
+    kill(bcast_pid, SIGTERM);
+  }
+  sa.sa_handler = SIG_DFL; //reap here rather than in sigchld_handler
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGCHLD, &sa, NULL);
+  while (wait(NULL) > 0 || errno == EINTR);
+  printf("listener: handed over, exiting\n");
+  exit(0);
+}
+/********************************************************************************
+MONOTONIC_MS
+Arguments: N/A
+Returns: CLOCK_MONOTONIC in milliseconds
+********************************************************************************/
+long long monotonic_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+/********************************************************************************
+CLIENT_REPORT
+Prints the client sketches. At the end of a period the period's sketch is
+printed, merged into the running total and cleared; an on demand report
+prints the total including the period so far.
+
+Arguments: struct client_sketch *recent: clients in the current period
+           struct client_sketch *total: clients in earlier periods
+           struct client_sketch *scratch: work space for a merged copy
+           int interval: length of the period that ended, 0 on demand
+Returns: N/A
+********************************************************************************/
+void client_report(struct client_sketch *recent, struct client_sketch *total,
+		   struct client_sketch *scratch, int interval){
+  char label[64];
+
+  if (interval > 0){
+    snprintf(label, sizeof(label), "last %ds", interval);
+    sketch_report(recent, label);
+    sketch_merge(total, recent);
+    sketch_report(total, "since start");
+    sketch_init(recent);
+  } else{
+    *scratch = *total;
+    sketch_merge(scratch, recent);
+    sketch_report(scratch, "since start");
+  }
+  return;
+}
+/********************************************************************************
 MAIN
 
 creates and initialises variables, call socket initializer to create a
@@ -281,31 +554,182 @@ int main(int argc, char *argv[]){
   char address_array[INET6_ADDRSTRLEN];
   int exitstrat;
   int rv;
+  int opt;
+  struct filter_stats fstats;
+  struct server_config cfg, next;
+  char *config_path = NULL;
+  char *ctl_path = NULL;
+  int ctlfd = -1;
+  int handed[HANDOFFMAXFDS + 1];
+  int nhanded = 0;
+  pid_t bcast_pid;
+  struct pollfd pfds[2];
+  struct client_sketch *recent, *total, *scratch;
+  long long next_report = 0, now_ms;
+  int timeout, stats_interval;
   /* 		  end of variables 		   */
 
-  exitstrat = socket_initializer(&hints, serverinfo, p, &sockfd, &rv);
-  switch(exitstrat){
-  case 1:
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+  config_defaults(&cfg);
+  while ((opt = getopt(argc, argv, "s:b:i:U:c:u:")) != -1){
+    switch(opt){
+    case 's':
+      snprintf(cfg.shm_name, sizeof(cfg.shm_name), "%s", optarg);
+      break;
+    case 'b':
+      snprintf(cfg.broadcast, sizeof(cfg.broadcast), "%s", optarg);
+      break;
+    case 'i':
+      if ((cfg.broadcast_interval = atoi(optarg)) <= 0){
+	fprintf(stderr, "broadcast interval must be positive\n");
+	return 1;
+      }
+      break;
+    case 'U':
+      if (config_add_upstream(&cfg, optarg, NULL) != 0){
+	fprintf(stderr, "at most %d upstream servers\n", UPSTREAMMAX);
+	return 1;
+      }
+      break;
+    case 'c':
+      config_path = optarg;
+      break;
+    case 'u':
+      ctl_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s shm_name] [-b address [-i seconds]]"
+	      " [-U server]... [-c config] [-u path]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (config_path != NULL && config_load(config_path, &cfg) != 0){
     return 1;
-    break;
-  case 2:
-    fprintf(stderr, "listener: failed to bind socket\n");
-    return 2;
-    break;
-  default:
-    break;
+  }
+  if (cfg.shm_name[0] && time_source_init(TS_SHM, cfg.shm_name) != 0){
+    return 1;
+  }
+
+  if (ctl_path != NULL){
+    nhanded = handoff_receive(ctl_path, handed, HANDOFFMAXFDS + 1);
+    if (nhanded < 0){
+      return 4;
+    }
+  }
+  if (nhanded > 0){
+    sockfd = handed[0]; //take over the running server's socket
+    for (i = 1; i < nhanded; i++){
+      close(handed[i]);
+    }
+    printf("listener: took over socket from running server\n");
+  } else{
+    exitstrat = socket_initializer(&hints, serverinfo, p, &sockfd, &rv);
+    switch(exitstrat){
+    case 1:
+      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+      return 1;
+      break;
+    case 2:
+      fprintf(stderr, "listener: failed to bind socket\n");
+      return 2;
+      break;
+    default:
+      break;
+    }
+  }
+  memset(&fstats, 0, sizeof(fstats));
+  if (filter_attach(sockfd, &fstats) != 0){
+    fprintf(stderr, "listener: filtering in user space only\n");
   }
   signal_handler(); // reap dead processes
+  if (upstream_start(&cfg) != 0){
+    return 1;
+  }
+  if ((bcast_pid = broadcast_start(&cfg, sockfd)) == -1){
+    return 3;
+  }
+  //once acknowledged the old server drains and exits
+  if (nhanded > 0 && handoff_acknowledge(handed[nhanded]) != 0){
+    fprintf(stderr, "listener: running server kept serving\n");
+    return 4;
+  }
+  if (ctl_path != NULL && (ctlfd = handoff_listen(ctl_path)) == -1){
+    fprintf(stderr, "listener: handoff disabled\n");
+  }
+  if ((recent = malloc(3 * sizeof(*recent))) == NULL){
+    perror("listener: malloc");
+    return 1;
+  }
+  total = recent + 1;
+  scratch = recent + 2;
+  sketch_init(recent);
+  sketch_init(total);
+  next_report = monotonic_ms() + cfg.stats_interval * 1000LL;
   printf("listener: listening...\n");
+  fflush(stdout);
   while (1){ 
-    addr_len = sizeof their_addr;
+    if (report_requested){
+      report_requested = 0;
+      filter_report(sockfd, &fstats);
+      upstream_report();
+      client_report(recent, total, scratch, 0);
+    }
+    if (reload_requested){
+      reload_requested = 0;
+      next = cfg;
+      if (config_path != NULL && config_load(config_path, &next) == 0){
+	stats_interval = cfg.stats_interval;
+	config_apply(&cfg, &next, &bcast_pid, sockfd);
+	if (cfg.stats_interval != stats_interval){
+	  next_report = monotonic_ms() + cfg.stats_interval * 1000LL;
+	}
+	printf("listener: configuration reloaded\n");
+	fflush(stdout);
+      }
+    }
 
-    if ((numbytes = recvfrom(sockfd, buffer, sizeof(buffer) , 0,
+    timeout = -1; //no periodic reports
+    if (cfg.stats_interval > 0){
+      now_ms = monotonic_ms();
+      if (now_ms >= next_report){
+	client_report(recent, total, scratch, cfg.stats_interval);
+	next_report = now_ms + cfg.stats_interval * 1000LL;
+      }
+      timeout = next_report - now_ms;
+    }
+
+    pfds[0].fd = sockfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = ctlfd; //ignored by poll when -1
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, timeout) == -1){
+      if (errno == EINTR){
+	continue; // signal, handled at the top of the loop
+      }
+      perror("poll");
+      exit(1);
+    }
+    if (pfds[1].revents & POLLIN){
+      if (handoff_send(ctlfd, &sockfd, 1) == 0){
+	drain_and_exit(sockfd, bcast_pid);
+      }
+    }
+    if (!(pfds[0].revents & POLLIN)){
+      continue;
+    }
+
+    addr_len = sizeof their_addr;
+    if ((numbytes = recvfrom(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT,
 			     (struct sockaddr *)&their_addr, &addr_len)) == -1){
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK){
+	continue;
+      }
       perror("recvfrom");
       exit(1); // receive packet
     }
+    sketch_add(recent, &their_addr); //junk senders count as clients too
+    if (packet_validate(buffer, numbytes, &fstats) != VALID_REQUEST){
+      continue; // not a request, don't fork for it
+    }
 
     if( !fork()){
       //more variables
@@ -317,21 +741,26 @@ int main(int argc, char *argv[]){
       memset(&Sent.bytes, 0, sizeof(Sent.bytes)); //clear
       //set received timestamp
       local_time_finder(&Sent, &state);
-      //finder ip address
-      ip_finder(their_addr, address_array);
-	  
-      printf("listener: packet is %d bytes long\n", numbytes); 
-      for(i=0;i<sizeof(buffer); i++){
-        printf("%02x", buffer[i]);
-        if(((i+1)%4 == 0) & (i != 0)){ 
-          printf("\n");
-        }
-      } 
+      if (cfg.verbose){
+	//finder ip address
+	ip_finder(their_addr, address_array);
+
+	printf("listener: packet is %d bytes long\n", numbytes); 
+	for(i=0;i<sizeof(buffer); i++){
+	  printf("%02x", buffer[i]);
+	  if(((i+1)%4 == 0) & (i != 0)){ 
+	    printf("\n");
+	  }
+	}
+      }
       packet_constructor(&Sent, &Received, buffer);//fill packet
       local_time_finder(&Sent, &state);//fill in transmit timestamp
       exitstrat = sender(&sockfd, &Sent, their_addr, addr_len, &numbytes);//send
       if (exitstrat ==1)
         exit(1);
+      if (cfg.verbose){
+	printf("Sent response\n");
+      }
       exit( 0); //end child
     }//fork()//
   }//while//
@@ -0,0 +1,121 @@
+/********************************************************************************
+Program Name: SNTP Server - packet building
+Description:
+Builds unicast replies and broadcast packets, see packet.h.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <string.h>
+#include <arpa/inet.h>
+#include "packet.h"
+#include "timesource.h"
+#include "upstream.h"
+
+/********************************************************************************
+HEADER_CONSTRUCTOR
+Fills in the header fields common to every packet the server sends,
+taking the reference fields from the current upstream snapshot
+
+Arguments: union Packetmagic *Sent: The response packet architecture
+           unsigned char topline: VN and mode, LI comes from the snapshot
+           unsigned char poll: log2 of the poll interval in seconds
+Returns: N/A
+********************************************************************************/
+void header_constructor(union Packetmagic *Sent, unsigned char topline,
+			unsigned char poll){
+  const struct upstream_snapshot *ref = upstream_current();
+
+  Sent->packet.header.topline = (ref->leap << 6) | (topline & 0x3f);
+  Sent->packet.header.strat = ref->stratum;
+  Sent->packet.header.poll = poll;
+  Sent->packet.header.precision = ref->precision;
+  Sent->packet.root_delay = ref->root_delay;
+  Sent->packet.root_dispersion = ref->root_dispersion;
+  Sent->packet.reference_id = ref->reference_id;
+  Sent->packet.ref.sec = ref->ref_sec;
+  Sent->packet.ref.frac = ref->ref_frac;
+  return;
+}
+/********************************************************************************
+PACKET_CONSTRUCTOR
+Fills in various parts of the response packet
+
+Arguments: union Packetmagic *Sent: The response packet architecture
+           union Packetmagic *Received: The request packet architecture
+           unsigned char *buffer: raw data from socket
+Returns: N/A
+********************************************************************************/
+void packet_constructor(union Packetmagic *Sent,
+			union Packetmagic *Received,
+			unsigned char *buffer){
+
+  memcpy(Received->bytes, buffer,
+	 sizeof(Received->bytes));  //transfer buffer to receive packet.
+
+  header_constructor(Sent, 0x24, Received->packet.header.poll); //mode 4
+
+  //transfer to originate timestamp
+  memcpy(&Sent->packet.origin.sec,
+	 &Received->packet.transmit.sec,
+	 sizeof(Received->packet.transmit.sec));
+  //transfer to originate timestamp
+  memcpy(&Sent->packet.origin.frac,
+	 &Received->packet.transmit.frac,
+	 sizeof(Received->packet.transmit.frac));
+  return;
+}
+/********************************************************************************
+BROADCAST_CONSTRUCTOR
+Builds a complete broadcast packet. There is no request, so the originate
+and receive timestamps stay zero and only the transmit (and reference)
+timestamps are filled in.
+
+Arguments: union Packetmagic *Sent: The broadcast packet architecture
+           unsigned char poll: log2 of the broadcast interval
+Returns: N/A
+********************************************************************************/
+void broadcast_constructor(union Packetmagic *Sent, unsigned char poll){
+  int state = 0; //transmit timestamp only
+
+  memset(Sent->bytes, 0, sizeof(Sent->bytes)); //clear
+  header_constructor(Sent, 0x25, poll); //LI 0, VN 4, mode 5
+  local_time_finder(Sent, &state);
+  return;
+}
+
+/********************************************************************************
+LOCAL_TIME_FINDER
+Fills in response packet timestamps. On first call the receive timestamp
+ is filled in, on the second call the transmit timestamp is filled in.
+ Serving the local clock there is no separate reference time, so the
+ transmit time is used for it too.
+
+Arguments: union Packetmagic *Sent: The response packet architecture
+           in *state: Tracks whether first call or second call
+Returns: N/A 
+********************************************************************************/
+
+void local_time_finder(union Packetmagic *Sent, int *state){
+  struct timestamps servertime;
+  time_source_now(&servertime);
+
+  if(*state){
+    Sent->packet.receive.sec = htonl(servertime.sec); //create
+    Sent->packet.receive.frac = htonl(servertime.frac);
+    *state = 0;
+  } else{
+    Sent->packet.transmit.sec = htonl(servertime.sec); //create
+    Sent->packet.transmit.frac = htonl(servertime.frac);
+
+    if (Sent->packet.ref.sec == 0){ //local clock
+      memcpy(&Sent->packet.ref.sec, &Sent->packet.transmit.sec,
+	     sizeof(Sent->packet.transmit.sec));
+      memcpy(&Sent->packet.ref.frac, &Sent->packet.transmit.frac,
+	     sizeof(Sent->packet.transmit.frac));
+    }
+    *state = 1;
+  }
+  return;
+}
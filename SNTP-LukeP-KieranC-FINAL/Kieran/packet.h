@@ -0,0 +1,25 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "structure.h"
+
+/********************************************************************************
+PACKET BUILDING
+Fills in the packets the server sends. Kept apart from main.c so that
+anything able to supply a request and a clock (see time_source_hook) can
+build replies exactly as the server does, without its sockets.
+
+A reply is built in three steps, in this order:
+   local_time_finder(&Sent, &state)   state 1: receive timestamp
+   packet_constructor(&Sent, ...)     header and originate timestamp
+   local_time_finder(&Sent, &state)   state 0: transmit timestamp
+********************************************************************************/
+
+void header_constructor(union Packetmagic *Sent, unsigned char topline,
+			unsigned char poll);
+void packet_constructor(union Packetmagic *Sent,
+			union Packetmagic *Received, unsigned char *buffer);
+void broadcast_constructor(union Packetmagic *Sent, unsigned char poll);
+void local_time_finder(union Packetmagic *Sent, int *state);
+
+#endif
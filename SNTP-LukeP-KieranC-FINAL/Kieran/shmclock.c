@@ -0,0 +1,312 @@
+/********************************************************************************
+Program Name: SNTP shared memory clock
+Description:
+Publishes the system clock into a shared memory page that the SNTP server
+(main.c, started with -s) reads through timesource.c. Every period the
+publisher pairs a CLOCK_REALTIME reading with a raw counter reading
+(CLOCK_MONOTONIC_RAW, or the TSC with -T) and stores the pair plus the
+measured slope under a sequence lock. The server then extrapolates the
+current NTP time with a counter read, a subtract, a multiply and a shift.
+
+Run with -c to check an existing page: it reports the extrapolation error
+against clock_gettime and the cost per timestamp of each way of reading the
+time.
+
+Usage: ./shmclock [-n name] [-p period_ms] [-T]
+       ./shmclock -c [-n name]
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "timesource.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define DEFAULT_PERIOD_MS 1000 //publish interval
+#define STALE_PERIODS 4        //readers give up after this many missed updates
+#define SAMPLE_TRIES 5         //counter/clock pairs taken per sample
+#define CHECK_SAMPLES 100000   //accuracy check samples
+#define BENCH_CALLS 10000000   //cost comparison calls per method
+#define NTPFRACTIONCONSTANT 4294967295.0  //number of fraction states in second
+#define EPOCH 2208988800U //Linux epoc (1900-1970)
+
+static volatile uint64_t sink; //stops the benchmark loops being optimised out
+
+/********************************************************************************
+SAMPLE
+Reads the system clock bracketed by two counter reads, keeping the tightest
+of a few tries, and pairs the clock with the counter midpoint.
+
+Arguments: unsigned int kind: counter to use
+           uint64_t *counter: counter at the time of the reading
+           uint64_t *ntp: system clock as an NTP timestamp
+Returns: N/A
+********************************************************************************/
+static void sample(unsigned int kind, uint64_t *counter, uint64_t *ntp){
+  uint64_t c0, c1, now, best = UINT64_MAX;
+  int i;
+
+  for (i = 0; i < SAMPLE_TRIES; i++){
+    c0 = counter_read(kind);
+    now = system_ntp_now();
+    c1 = counter_read(kind);
+    if (c1 - c0 < best){
+      best = c1 - c0;
+      *counter = c0 + (c1 - c0) / 2;
+      *ntp = now;
+    }
+  }
+}
+
+/********************************************************************************
+SLOPE_BETWEEN
+Arguments: two samples
+Returns: NTP units per counter tick in 32.32 fixed point
+********************************************************************************/
+static uint64_t slope_between(uint64_t c0, uint64_t n0,
+			      uint64_t c1, uint64_t n1){
+  if (c1 <= c0){
+    return 0;
+  }
+  return (uint64_t)(((unsigned __int128)(n1 - n0) << 32) / (c1 - c0));
+}
+
+/********************************************************************************
+PUBLISH
+Writes a new base and slope under the sequence lock
+
+Arguments: struct shm_clock *clk: the page
+           the values to publish
+Returns: N/A
+********************************************************************************/
+static void publish(struct shm_clock *clk, unsigned int kind,
+		    uint64_t counter, uint64_t ntp, uint64_t slope,
+		    uint64_t stale){
+  unsigned int seq = atomic_load_explicit(&clk->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&clk->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&clk->counter_kind, kind, memory_order_relaxed);
+  atomic_store_explicit(&clk->counter_base, counter, memory_order_relaxed);
+  atomic_store_explicit(&clk->ntp_base, ntp, memory_order_relaxed);
+  atomic_store_explicit(&clk->slope, slope, memory_order_relaxed);
+  atomic_store_explicit(&clk->stale_ticks, stale, memory_order_relaxed);
+  atomic_store_explicit(&clk->seq, seq + 2, memory_order_release);
+}
+
+/********************************************************************************
+SLEEP_MS
+Arguments: long ms: milliseconds to sleep
+Returns: N/A
+********************************************************************************/
+static void sleep_ms(long ms){
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) == -1);
+}
+
+/********************************************************************************
+RUN_PUBLISHER
+Creates the page and keeps it updated until killed
+
+Arguments: const char *name: shm_open name
+           long period_ms: update interval
+           unsigned int kind: counter to publish against
+Returns: error handle
+********************************************************************************/
+static int run_publisher(const char *name, long period_ms, unsigned int kind){
+  int fd;
+  struct shm_clock *clk;
+  uint64_t c_prev, n_prev, c_now, n_now;
+
+  if ((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) == -1){
+    perror("shmclock: shm_open");
+    return 1;
+  }
+  if (ftruncate(fd, sizeof(struct shm_clock)) == -1){
+    perror("shmclock: ftruncate");
+    close(fd);
+    return 1;
+  }
+  clk = mmap(NULL, sizeof(struct shm_clock), PROT_READ | PROT_WRITE,
+	     MAP_SHARED, fd, 0);
+  close(fd);
+  if (clk == MAP_FAILED){
+    perror("shmclock: mmap");
+    return 1;
+  }
+  clk->magic = SHM_MAGIC;
+  clk->version = SHM_VERSION;
+
+  //initial slope from a short calibration interval
+  sample(kind, &c_prev, &n_prev);
+  sleep_ms(100);
+  sample(kind, &c_now, &n_now);
+  publish(clk, kind, c_now, n_now,
+	  slope_between(c_prev, n_prev, c_now, n_now),
+	  (c_now - c_prev) * 10 * STALE_PERIODS * period_ms / 1000);
+  printf("shmclock: publishing %s every %ld ms (%s)\n", name, period_ms,
+	 kind == SHM_COUNTER_TSC ? "tsc" : "monotonic raw");
+
+  while (1){
+    c_prev = c_now;
+    n_prev = n_now;
+    sleep_ms(period_ms);
+    sample(kind, &c_now, &n_now);
+    publish(clk, kind, c_now, n_now,
+	    slope_between(c_prev, n_prev, c_now, n_now),
+	    (c_now - c_prev) * STALE_PERIODS);
+  }
+  return 0;
+}
+
+/********************************************************************************
+NTP_DIFF_NS
+Arguments: uint64_t a, b: NTP timestamps
+Returns: a - b in nanoseconds
+********************************************************************************/
+static double ntp_diff_ns(uint64_t a, uint64_t b){
+  return (double)(int64_t)(a - b) * 1e9 / 4294967296.0;
+}
+
+/********************************************************************************
+MONO_NS
+Returns: CLOCK_MONOTONIC in nanoseconds, for timing the benchmark loops
+********************************************************************************/
+static uint64_t mono_ns(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/********************************************************************************
+LEGACY_NTP_NOW
+The original server conversion: gettimeofday plus floating point
+Returns: NTP timestamp
+********************************************************************************/
+static uint64_t legacy_ntp_now(void){
+  struct timeval servertime;
+  gettimeofday(&servertime, NULL);
+  return ((uint64_t)(servertime.tv_sec + EPOCH) << 32) |
+    (unsigned int)((servertime.tv_usec * 1e-6) * NTPFRACTIONCONSTANT);
+}
+
+/********************************************************************************
+RUN_CHECK
+Compares the page against clock_gettime and times each method
+
+Arguments: const char *name: shm_open name
+Returns: error handle
+********************************************************************************/
+static int run_check(const char *name){
+  const struct shm_clock *clk;
+  uint64_t before, after, shm, start;
+  double err, sum = 0, sumsq = 0, worst = 0;
+  long i;
+
+  if ((clk = shm_clock_open(name)) == NULL){
+    return 1;
+  }
+  if (shm_clock_read(clk, &shm) != 0){
+    fprintf(stderr, "shmclock: %s is not being published\n", name);
+    return 1;
+  }
+
+  for (i = 0; i < CHECK_SAMPLES; i++){
+    before = system_ntp_now();
+    shm_clock_read(clk, &shm);
+    after = system_ntp_now();
+    err = ntp_diff_ns(shm, before) - ntp_diff_ns(after, before) / 2;
+    sum += err;
+    sumsq += err * err;
+    if (fabs(err) > worst){
+      worst = fabs(err);
+    }
+  }
+  printf("accuracy vs clock_gettime over %d samples:\n", CHECK_SAMPLES);
+  printf("\tmean error %.1f ns, rms %.1f ns, worst %.1f ns\n",
+	 sum / CHECK_SAMPLES, sqrt(sumsq / CHECK_SAMPLES), worst);
+
+  printf("cost per timestamp over %d calls:\n", BENCH_CALLS);
+  start = mono_ns();
+  for (i = 0; i < BENCH_CALLS; i++){
+    shm_clock_read(clk, &shm);
+    sink += shm;
+  }
+  printf("\tshm extrapolation          %6.1f ns\n",
+	 (double)(mono_ns() - start) / BENCH_CALLS);
+
+  start = mono_ns();
+  for (i = 0; i < BENCH_CALLS; i++){
+    sink += system_ntp_now();
+  }
+  printf("\tclock_gettime + integer    %6.1f ns\n",
+	 (double)(mono_ns() - start) / BENCH_CALLS);
+
+  start = mono_ns();
+  for (i = 0; i < BENCH_CALLS; i++){
+    sink += legacy_ntp_now();
+  }
+  printf("\tgettimeofday + float       %6.1f ns\n",
+	 (double)(mono_ns() - start) / BENCH_CALLS);
+  return 0;
+}
+
+/********************************************************************************
+MAIN
+Parses options and either publishes or checks the page
+********************************************************************************/
+int main(int argc, char *argv[]){
+  const char *name = SHM_DEFAULT_NAME;
+  long period_ms = DEFAULT_PERIOD_MS;
+  unsigned int kind = SHM_COUNTER_MONORAW;
+  int check = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:p:Tc")) != -1){
+    switch(opt){
+    case 'n':
+      name = optarg;
+      break;
+    case 'p':
+      period_ms = atol(optarg);
+      break;
+    case 'T':
+#if defined(__x86_64__) || defined(__i386__)
+      kind = SHM_COUNTER_TSC;
+#else
+      fprintf(stderr, "shmclock: no TSC on this platform, using raw clock\n");
+#endif
+      break;
+    case 'c':
+      check = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n name] [-p period_ms] [-T] | -c [-n name]\n",
+	      argv[0]);
+      return 1;
+    }
+  }
+  if (period_ms <= 0){
+    fprintf(stderr, "shmclock: period must be positive\n");
+    return 1;
+  }
+  if (check){
+    return run_check(name);
+  }
+  return run_publisher(name, period_ms, kind);
+}
@@ -0,0 +1,293 @@
+/********************************************************************************
+Program Name: SNTP Server - client sketches
+Description:
+HyperLogLog and Count-Min sketches of the clients sending to the server,
+see sketch.h.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "sketch.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define HLLALPHA (0.7213 / (1 + 1.079 / SKETCHHLLREGISTERS))
+
+/*Count-Min row index: each row takes its own slice of the low hash bits,
+ *clear of the top SKETCHHLLBITS used for the HyperLogLog register*/
+#define CMINDEX(hash, row) \
+  (((hash) >> ((row) * SKETCHCMBITS)) & (SKETCHCMWIDTH - 1))
+
+/********************************************************************************
+MIX64
+Arguments: uint64_t x: value to scramble
+Returns: x with every bit depending on every input bit (murmur3 finaliser)
+********************************************************************************/
+static uint64_t mix64(uint64_t x){
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/********************************************************************************
+ADDRESS_KEY
+Reduces a source address to its family and address bytes. IPv4 mapped
+IPv6 addresses count as the IPv4 address.
+
+Arguments: const struct sockaddr_storage *addr: source address
+           uint8_t *family: AF_INET or AF_INET6
+           uint8_t *bytes: 16 bytes, the address left aligned
+Returns: hash of the address, never 0
+********************************************************************************/
+static uint64_t address_key(const struct sockaddr_storage *addr,
+			    uint8_t *family, uint8_t *bytes){
+  const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+  uint64_t hi, lo, hash;
+  uint32_t v4;
+
+  if (addr->ss_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)){
+    *family = AF_INET6;
+    memcpy(&hi, &in6->sin6_addr.s6_addr[0], 8);
+    memcpy(&lo, &in6->sin6_addr.s6_addr[8], 8);
+    memcpy(bytes, &in6->sin6_addr, 16);
+    hash = mix64(hi ^ mix64(lo ^ AF_INET6));
+  } else{
+    *family = AF_INET;
+    if (addr->ss_family == AF_INET6){
+      memcpy(&v4, &in6->sin6_addr.s6_addr[12], 4);
+    } else{
+      memcpy(&v4, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+    memset(bytes, 0, 16);
+    memcpy(bytes, &v4, 4);
+    hash = mix64(v4 ^ ((uint64_t)AF_INET << 32));
+  }
+  return hash ? hash : 1;
+}
+
+/********************************************************************************
+CM_ESTIMATE
+Arguments: const struct client_sketch *s: sketch
+           uint64_t hash: address hash
+Returns: Count-Min estimate of the packets from that address
+********************************************************************************/
+static uint32_t cm_estimate(const struct client_sketch *s, uint64_t hash){
+  uint32_t est = UINT32_MAX, c;
+  int row;
+
+  for (row = 0; row < SKETCHCMDEPTH; row++){
+    c = s->cm[row][CMINDEX(hash, row)];
+    if (c < est){
+      est = c;
+    }
+  }
+  return est;
+}
+
+/********************************************************************************
+FIND_TOP_MIN
+Arguments: struct client_sketch *s: sketch whose top_min is recomputed
+Returns: N/A
+********************************************************************************/
+static void find_top_min(struct client_sketch *s){
+  int i;
+
+  s->top_min = 0;
+  for (i = 1; i < SKETCHTOP; i++){
+    if (s->top[i].count < s->top[s->top_min].count){
+      s->top_min = i;
+    }
+  }
+}
+
+/********************************************************************************
+OFFER_TOP
+Keeps an address in the top talkers if its estimate is large enough
+
+Arguments: struct client_sketch *s: sketch
+           const struct sketch_talker *t: address and its current estimate
+Returns: N/A
+********************************************************************************/
+static void offer_top(struct client_sketch *s, const struct sketch_talker *t){
+  int i;
+
+  /*Estimates never fall, so an address already kept has an estimate of at
+   *least the smallest kept count: below it there is nothing to do*/
+  if (t->count < s->top[s->top_min].count){
+    return;
+  }
+  for (i = 0; i < SKETCHTOP; i++){
+    if (s->top[i].hash == t->hash){
+      s->top[i].count = t->count;
+      if (i == s->top_min){
+	find_top_min(s);
+      }
+      return;
+    }
+  }
+  if (t->count > s->top[s->top_min].count){
+    s->top[s->top_min] = *t; //empty entries have count 0 and go first
+    find_top_min(s);
+  }
+}
+
+/********************************************************************************
+SKETCH_INIT
+Arguments: struct client_sketch *s: sketch to clear
+Returns: N/A
+********************************************************************************/
+void sketch_init(struct client_sketch *s){
+  memset(s, 0, sizeof(*s));
+}
+
+/********************************************************************************
+SKETCH_ADD
+Counts one datagram: a hash, one register update and SKETCHCMDEPTH counter
+increments, plus a scan of the top talkers.
+
+Arguments: struct client_sketch *s: sketch to update
+           const struct sockaddr_storage *addr: source address
+Returns: N/A
+********************************************************************************/
+void sketch_add(struct client_sketch *s, const struct sockaddr_storage *addr){
+  struct sketch_talker t;
+  uint64_t rest;
+  uint32_t c;
+  uint8_t rank;
+  int row;
+
+  t.hash = address_key(addr, &t.family, t.addr);
+  s->packets++;
+
+  //HyperLogLog: top bits pick the register, leading zeros of the rest rank
+  rest = t.hash << SKETCHHLLBITS;
+  rank = rest ? __builtin_clzll(rest) + 1 : 64 - SKETCHHLLBITS + 1;
+  if (rank > s->hll[t.hash >> (64 - SKETCHHLLBITS)]){
+    s->hll[t.hash >> (64 - SKETCHHLLBITS)] = rank;
+  }
+
+  //Count-Min, counters stick at UINT32_MAX rather than wrap to 0
+  t.count = UINT32_MAX;
+  for (row = 0; row < SKETCHCMDEPTH; row++){
+    c = s->cm[row][CMINDEX(t.hash, row)];
+    if (c != UINT32_MAX){
+      s->cm[row][CMINDEX(t.hash, row)] = ++c;
+    }
+    if (c < t.count){
+      t.count = c;
+    }
+  }
+  offer_top(s, &t);
+}
+
+/********************************************************************************
+SKETCH_MERGE
+Adds src into dst, as if dst had also seen every packet src did
+
+Arguments: struct client_sketch *dst: sketch to update
+           const struct client_sketch *src: sketch to add
+Returns: N/A
+********************************************************************************/
+void sketch_merge(struct client_sketch *dst, const struct client_sketch *src){
+  struct sketch_talker candidates[2 * SKETCHTOP];
+  int i, j, n = 0;
+
+  dst->packets += src->packets;
+  for (i = 0; i < SKETCHHLLREGISTERS; i++){
+    if (src->hll[i] > dst->hll[i]){
+      dst->hll[i] = src->hll[i];
+    }
+  }
+  for (i = 0; i < SKETCHCMDEPTH; i++){
+    for (j = 0; j < SKETCHCMWIDTH; j++){
+      dst->cm[i][j] = src->cm[i][j] > UINT32_MAX - dst->cm[i][j] ?
+	UINT32_MAX : dst->cm[i][j] + src->cm[i][j];
+    }
+  }
+
+  //both top lists are candidates, re-estimated from the merged counters
+  for (i = 0; i < SKETCHTOP; i++){
+    if (dst->top[i].hash){
+      candidates[n++] = dst->top[i];
+    }
+    if (src->top[i].hash){
+      candidates[n++] = src->top[i];
+    }
+  }
+  memset(dst->top, 0, sizeof(dst->top));
+  dst->top_min = 0;
+  for (i = 0; i < n; i++){
+    candidates[i].count = cm_estimate(dst, candidates[i].hash);
+    offer_top(dst, &candidates[i]);
+  }
+}
+
+/********************************************************************************
+SKETCH_UNIQUE
+Arguments: const struct client_sketch *s: sketch
+Returns: estimated number of distinct source addresses
+********************************************************************************/
+double sketch_unique(const struct client_sketch *s){
+  double sum = 0, estimate;
+  int i, zeros = 0;
+
+  for (i = 0; i < SKETCHHLLREGISTERS; i++){
+    sum += ldexp(1.0, -s->hll[i]);
+    if (s->hll[i] == 0){
+      zeros++;
+    }
+  }
+  estimate = HLLALPHA * SKETCHHLLREGISTERS * SKETCHHLLREGISTERS / sum;
+  if (estimate <= 2.5 * SKETCHHLLREGISTERS && zeros != 0){
+    //small range correction: linear counting
+    estimate = SKETCHHLLREGISTERS * log((double)SKETCHHLLREGISTERS / zeros);
+  }
+  return estimate;
+}
+
+/********************************************************************************
+COMPARE_TALKERS
+qsort comparison, largest count first
+********************************************************************************/
+static int compare_talkers(const void *a, const void *b){
+  const struct sketch_talker *x = a, *y = b;
+
+  return (y->count > x->count) - (y->count < x->count);
+}
+
+/********************************************************************************
+SKETCH_REPORT
+Prints the distinct client estimate and the top talkers
+
+Arguments: const struct client_sketch *s: sketch
+           const char *label: what the sketch covers, e.g. "last 600s"
+Returns: N/A
+********************************************************************************/
+void sketch_report(const struct client_sketch *s, const char *label){
+  struct sketch_talker top[SKETCHTOP];
+  char address[INET6_ADDRSTRLEN];
+  int i;
+
+  printf("clients (%s): %llu packets from ~%.0f addresses\n", label,
+	 (unsigned long long)s->packets, sketch_unique(s));
+  memcpy(top, s->top, sizeof(top));
+  qsort(top, SKETCHTOP, sizeof(top[0]), compare_talkers);
+  for (i = 0; i < SKETCHTOP && top[i].hash; i++){
+    printf("  %-39s ~%u (%.1f%%)\n",
+	   inet_ntop(top[i].family, top[i].addr, address, sizeof(address)),
+	   top[i].count, 100.0 * top[i].count / s->packets);
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,50 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/********************************************************************************
+CLIENT SKETCHES
+Fixed size summaries of who sends to the server, updated by the receive
+loop for every datagram. Memory does not grow with the number of clients.
+
+A HyperLogLog counts distinct source addresses (about 0.8% error with
+SKETCHHLLBITS 14). A Count-Min sketch estimates packets per address (an
+overestimate, by at most about e/SKETCHCMWIDTH of all packets with high
+probability) and the SKETCHTOP addresses with the largest estimates are
+kept as top talkers. Ports are ignored: one client, many source ports.
+
+Each receive loop keeps its own sketch; sketch_merge combines two, so
+separate loops or separate intervals can be added together when reporting.
+********************************************************************************/
+
+#define SKETCHHLLBITS 14                   //HyperLogLog index bits
+#define SKETCHHLLREGISTERS (1 << SKETCHHLLBITS)
+#define SKETCHCMDEPTH 4                    //Count-Min rows
+#define SKETCHCMBITS 11                    //row index bits
+#define SKETCHCMWIDTH (1 << SKETCHCMBITS)  //counters per row
+#define SKETCHTOP 10                       //top talkers kept
+
+struct sketch_talker{
+  uint64_t hash;     //0 for an empty entry
+  uint32_t count;    //Count-Min estimate
+  uint8_t family;    //AF_INET or AF_INET6
+  uint8_t addr[16];
+};
+
+struct client_sketch{
+  uint64_t packets;
+  uint8_t hll[SKETCHHLLREGISTERS];
+  uint32_t cm[SKETCHCMDEPTH][SKETCHCMWIDTH]; //saturate at UINT32_MAX
+  struct sketch_talker top[SKETCHTOP];
+  int top_min; //index of the smallest top entry
+};
+
+void sketch_init(struct client_sketch *s);
+void sketch_add(struct client_sketch *s, const struct sockaddr_storage *addr);
+void sketch_merge(struct client_sketch *dst, const struct client_sketch *src);
+double sketch_unique(const struct client_sketch *s);
+void sketch_report(const struct client_sketch *s, const char *label);
+
+#endif
@@ -0,0 +1,208 @@
+/********************************************************************************
+Program Name: SNTP Server - time sources
+Description:
+Provides the current time to the server in NTP format. Either straight from
+the kernel clock, or extrapolated from the shared memory page published by
+shmclock (see shmclock.c) so that workers do not make a system call or any
+floating point conversion per timestamp.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "timesource.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define EPOCH 2208988800U //Linux epoc (1900-1970)
+
+#define SHM_READ_TRIES 1000 //give up on a page stuck mid update
+
+static int source_kind = TS_SYSTEM;
+static const struct shm_clock *source_page = NULL;
+static time_source_fn source_hook = NULL;
+static void *source_hook_arg = NULL;
+
+/********************************************************************************
+COUNTER_READ
+Reads the raw counter the shm page is expressed against
+
+Arguments: unsigned int kind: SHM_COUNTER_MONORAW or SHM_COUNTER_TSC
+Returns: counter value
+********************************************************************************/
+uint64_t counter_read(unsigned int kind){
+  struct timespec now;
+#if defined(__x86_64__) || defined(__i386__)
+  if (kind == SHM_COUNTER_TSC){
+    return __rdtsc();
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/********************************************************************************
+SYSTEM_NTP_NOW
+Reads CLOCK_REALTIME and converts it to a 32.32 NTP timestamp using integer
+arithmetic only
+
+Arguments: N/A
+Returns: NTP timestamp (host order)
+********************************************************************************/
+uint64_t system_ntp_now(void){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return ((uint64_t)(now.tv_sec + EPOCH) << 32) |
+    (((uint64_t)now.tv_nsec << 32) / 1000000000ULL);
+}
+
+/********************************************************************************
+SHM_CLOCK_READ
+Extrapolates the current NTP time from the shared page
+
+Arguments: const struct shm_clock *clk: the mapped page
+           uint64_t *ntp: where to store the NTP timestamp (host order)
+Returns: 0 on success, 1 if the page is not valid or has gone stale
+********************************************************************************/
+int shm_clock_read(const struct shm_clock *clk, uint64_t *ntp){
+  unsigned int seq1, seq2, kind;
+  uint64_t counter_base, ntp_base, slope, stale, now;
+  int tries = 0;
+
+  do{
+    if (tries++ == SHM_READ_TRIES){
+      return 1; //publisher died mid update
+    }
+    seq1 = atomic_load_explicit(&clk->seq, memory_order_acquire);
+    kind = atomic_load_explicit(&clk->counter_kind, memory_order_relaxed);
+    counter_base = atomic_load_explicit(&clk->counter_base,
+					memory_order_relaxed);
+    ntp_base = atomic_load_explicit(&clk->ntp_base, memory_order_relaxed);
+    slope = atomic_load_explicit(&clk->slope, memory_order_relaxed);
+    stale = atomic_load_explicit(&clk->stale_ticks, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    seq2 = atomic_load_explicit(&clk->seq, memory_order_relaxed);
+  } while ((seq1 != seq2) || (seq1 & 1));
+
+  if (seq1 == 0 || slope == 0){
+    return 1; //never published
+  }
+  now = counter_read(kind);
+  if (now - counter_base > stale){
+    return 1; //publisher has stopped
+  }
+  *ntp = ntp_base +
+    (uint64_t)(((unsigned __int128)(now - counter_base) * slope) >> 32);
+  return 0;
+}
+
+/********************************************************************************
+SHM_CLOCK_OPEN
+Maps an existing shmclock page read only and checks its header
+
+Arguments: const char *name: shm_open name of the page
+Returns: the mapped page, or NULL on error
+********************************************************************************/
+const struct shm_clock *shm_clock_open(const char *name){
+  int fd;
+  void *map;
+  const struct shm_clock *clk;
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1){
+    perror("time source: shm_open");
+    return NULL;
+  }
+  map = mmap(NULL, sizeof(struct shm_clock), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED){
+    perror("time source: mmap");
+    return NULL;
+  }
+  clk = map;
+  if (clk->magic != SHM_MAGIC || clk->version != SHM_VERSION){
+    fprintf(stderr, "time source: %s is not a shmclock page\n", name);
+    munmap(map, sizeof(struct shm_clock));
+    return NULL;
+  }
+  return clk;
+}
+
+/********************************************************************************
+TIME_SOURCE_INIT
+Selects the time source used by time_source_now. For TS_SHM the page is
+mapped read only; it stays mapped in forked children. If the new page
+can't be opened the current source is left as it was; a page no longer in
+use is unmapped.
+
+Arguments: int kind: TS_SYSTEM or TS_SHM
+           const char *name: shm_open name of the page (TS_SHM only)
+Returns: error handle
+********************************************************************************/
+int time_source_init(int kind, const char *name){
+  const struct shm_clock *page = NULL;
+
+  if (kind == TS_SHM && (page = shm_clock_open(name)) == NULL){
+    return 1;
+  }
+  if (source_page != NULL){
+    munmap((void *)source_page, sizeof(struct shm_clock));
+  }
+  source_page = page;
+  source_kind = kind == TS_SHM ? TS_SHM : TS_SYSTEM;
+  return 0;
+}
+
+/********************************************************************************
+TIME_SOURCE_HOOK
+Makes time_source_now call a function for the time (TS_HOOK)
+
+Arguments: time_source_fn now: returns the current NTP time (host order)
+           void *arg: passed to now
+Returns: N/A
+********************************************************************************/
+void time_source_hook(time_source_fn now, void *arg){
+  source_hook = now;
+  source_hook_arg = arg;
+  source_kind = TS_HOOK;
+}
+
+/********************************************************************************
+TIME_SOURCE_KIND
+Arguments: N/A
+Returns: the source currently selected
+********************************************************************************/
+int time_source_kind(void){
+  return source_kind;
+}
+
+/********************************************************************************
+TIME_SOURCE_NOW
+Fills in a timestamp with the current time from the selected source. Falls
+back to the system clock if the shm page is stale.
+
+Arguments: struct timestamps *ts: filled in host byte order
+Returns: N/A
+********************************************************************************/
+void time_source_now(struct timestamps *ts){
+  uint64_t ntp;
+
+  if (source_kind == TS_HOOK){
+    ntp = source_hook(source_hook_arg);
+  } else if (source_kind != TS_SHM || shm_clock_read(source_page, &ntp) != 0){
+    ntp = system_ntp_now();
+  }
+  ts->sec = (unsigned int)(ntp >> 32);
+  ts->frac = (unsigned int)ntp;
+}
@@ -0,0 +1,60 @@
+#ifndef TIMESOURCE_H
+#define TIMESOURCE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "structure.h"
+
+/********************************************************************************
+TIME SOURCES
+The server reads the current time through time_source_now(). The system
+source reads the kernel clock directly; the shm source extrapolates from a
+base timestamp published by shmclock into a shared memory page, so the
+per-packet cost is a counter read and a multiply. A hook source calls a
+function instead, for simulations that drive the server from a virtual
+clock.
+********************************************************************************/
+
+#define TS_SYSTEM 0 //clock_gettime(CLOCK_REALTIME) per call
+#define TS_SHM 1    //extrapolate from shared memory page
+#define TS_HOOK 2   //ask a caller supplied function
+
+#define SHM_DEFAULT_NAME "/sntp_clock" //shm_open name
+#define SHM_MAGIC 0x534e5450U          //"SNTP"
+#define SHM_VERSION 1
+
+#define SHM_COUNTER_MONORAW 0 //counter is CLOCK_MONOTONIC_RAW in ns
+#define SHM_COUNTER_TSC 1     //counter is the x86 time stamp counter
+
+/*
+ * Layout of the shared page. The publisher bumps seq to an odd value,
+ * writes the fields, then bumps it to the next even value. Readers retry
+ * until they see the same even seq before and after reading the fields.
+ *
+ * ntp(now) = ntp_base + ((counter(now) - counter_base) * slope) >> 32
+ * where ntp_* is a 32.32 NTP timestamp and slope is in 32.32 fixed point
+ * NTP units per counter tick.
+ */
+struct shm_clock{
+  uint32_t magic;
+  uint32_t version;
+  atomic_uint seq;
+  atomic_uint counter_kind;
+  atomic_ullong counter_base;
+  atomic_ullong ntp_base;
+  atomic_ullong slope;
+  atomic_ullong stale_ticks; //readers fall back past this age
+};
+
+typedef uint64_t (*time_source_fn)(void *arg); //returns an NTP timestamp
+
+int time_source_init(int kind, const char *name);
+void time_source_hook(time_source_fn now, void *arg);
+void time_source_now(struct timestamps *ts);
+int time_source_kind(void);
+uint64_t counter_read(unsigned int kind);
+uint64_t system_ntp_now(void);
+const struct shm_clock *shm_clock_open(const char *name);
+int shm_clock_read(const struct shm_clock *clk, uint64_t *ntp);
+
+#endif
@@ -0,0 +1,519 @@
+/********************************************************************************
+Program Name: SNTP Server - upstream synchronisation
+Description:
+Polls the upstream servers from a background thread and publishes what the
+server should put in its replies. See upstream.h for how snapshots are
+published and retired.
+
+This file talks to upstream through the client library, so it includes
+../Luke/sntp_client.h and must not include structure.h: both define a
+struct sntp_packet.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "upstream.h"
+#include "../Luke/sntp_client.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define PHI 15e-6           //assumed frequency tolerance, seconds per second
+#define MAXSTRATUM 15       //upstreams below this: we add one, 16 is unsynchronised
+#define PRECISIONREADS 64   //clock reads used to measure precision
+#define MD5ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+struct upstream_ring{
+  _Atomic(struct upstream_snapshot *) current;
+  unsigned int next; //only touched by the publisher
+  struct upstream_snapshot slot[UPSTREAMSNAPSHOTS];
+};
+
+static struct upstream_ring *ring; //shared mapping, NULL until started
+static signed char local_precision;
+
+/*What the sync thread should poll, guarded by sync_lock*/
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_wake;
+static struct upstream_server wanted[UPSTREAMMAX];
+static int nwanted;
+static int poll_interval;
+static int reconfigured;
+
+/********************************************************************************
+NTP_SHORT
+Arguments: double seconds
+Returns: seconds in NTP short format (16.16), network order
+********************************************************************************/
+static uint32_t ntp_short(double seconds){
+  if (seconds < 0){
+    seconds = 0;
+  }
+  if (seconds >= 65535){
+    seconds = 65535;
+  }
+  return htonl((uint32_t)(seconds * 65536.0));
+}
+
+/********************************************************************************
+SHORT_SECONDS
+Arguments: uint32_t wire: NTP short format, network order
+Returns: seconds
+********************************************************************************/
+static double short_seconds(uint32_t wire){
+  return ntohl(wire) / 65536.0;
+}
+
+/********************************************************************************
+KISS_CODE
+Arguments: const char *code: up to four ASCII characters
+Returns: the code as a reference id
+********************************************************************************/
+static uint32_t kiss_code(const char *code){
+  uint32_t id = 0;
+  memcpy(&id, code, strnlen(code, sizeof(id)));
+  return id;
+}
+
+/********************************************************************************
+CLOCK_PRECISION
+Measures the smallest step the system clock takes between two reads
+
+Arguments: N/A
+Returns: precision as log2 seconds
+********************************************************************************/
+static signed char clock_precision(void){
+  struct timespec a, b;
+  long step, smallest = 1000000000L;
+  int i, p = 0;
+
+  for (i = 0; i < PRECISIONREADS; i++){
+    clock_gettime(CLOCK_REALTIME, &a);
+    do{
+      clock_gettime(CLOCK_REALTIME, &b);
+      step = (b.tv_sec - a.tv_sec) * 1000000000L + (b.tv_nsec - a.tv_nsec);
+    } while (step == 0);
+    if (step < smallest){
+      smallest = step;
+    }
+  }
+  while (ldexp(1.0, p - 1) >= smallest * 1e-9){
+    p--;
+  }
+  return p;
+}
+
+/********************************************************************************
+LOCAL_SNAPSHOT
+The local clock as a stratum 1 reference (no upstream servers)
+
+Arguments: struct upstream_snapshot *snap: filled in
+Returns: N/A
+********************************************************************************/
+static void local_snapshot(struct upstream_snapshot *snap){
+  memset(snap, 0, sizeof(*snap));
+  snap->stratum = 1;
+  snap->precision = local_precision;
+  snap->reference_id = kiss_code("LOCL");
+}
+
+/********************************************************************************
+UNSYNCHRONISED_SNAPSHOT
+Upstream is configured but has not answered yet
+
+Arguments: struct upstream_snapshot *snap: filled in
+Returns: N/A
+********************************************************************************/
+static void unsynchronised_snapshot(struct upstream_snapshot *snap){
+  memset(snap, 0, sizeof(*snap));
+  snap->leap = LEAPALARM;
+  snap->stratum = 0;
+  snap->precision = local_precision;
+  snap->reference_id = kiss_code("INIT");
+}
+
+/********************************************************************************
+MD5_SHORT
+MD5 (RFC 1321) of a message that fits in one block, which is all the
+reference id needs
+
+Arguments: const unsigned char *data: message
+           size_t len: its length, at most 55 bytes
+           unsigned char *digest: 16 bytes, filled in
+Returns: N/A
+********************************************************************************/
+static void md5_short(const unsigned char *data, size_t len,
+		      unsigned char *digest){
+  static const uint32_t k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+  static const unsigned char r[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+  static const uint32_t init[4] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  unsigned char block[64];
+  uint32_t m[16], h[4], f, tmp;
+  int i, g;
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, data, len);
+  block[len] = 0x80;
+  for (i = 0; i < 8; i++){
+    block[56 + i] = (uint8_t)(((uint64_t)len * 8) >> (8 * i));
+  }
+  for (i = 0; i < 16; i++){
+    m[i] = block[4 * i] | block[4 * i + 1] << 8 |
+      block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+  }
+
+  memcpy(h, init, sizeof(h));
+  for (i = 0; i < 64; i++){
+    if (i < 16){
+      f = (h[1] & h[2]) | (~h[1] & h[3]);
+      g = i;
+    } else if (i < 32){
+      f = (h[3] & h[1]) | (~h[3] & h[2]);
+      g = (5 * i + 1) % 16;
+    } else if (i < 48){
+      f = h[1] ^ h[2] ^ h[3];
+      g = (3 * i + 5) % 16;
+    } else{
+      f = h[2] ^ (h[1] | ~h[3]);
+      g = (7 * i) % 16;
+    }
+    tmp = h[3];
+    h[3] = h[2];
+    h[2] = h[1];
+    f += h[0] + k[i] + m[g];
+    h[1] += MD5ROTATE(f, r[(i / 16) * 4 + i % 4]);
+    h[0] = tmp;
+  }
+  for (i = 0; i < 16; i++){
+    digest[i] = (h[i / 4] + init[i / 4]) >> (8 * (i % 4));
+  }
+}
+
+/********************************************************************************
+ADDRESS_REFID
+Arguments: const struct sockaddr_storage *addr: upstream server
+Returns: reference id for a server synchronised to addr. IPv4 uses the
+address, IPv6 the first four octets of the MD5 hash of the address (RFC
+5905 7.3), so the id covers the whole address and not only its prefix.
+********************************************************************************/
+static uint32_t address_refid(const struct sockaddr_storage *addr){
+  unsigned char digest[16];
+  uint32_t id;
+
+  if (addr->ss_family == AF_INET6){
+    md5_short(((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16,
+	      digest);
+    memcpy(&id, digest, sizeof(id));
+    return id;
+  }
+  return ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+}
+
+/********************************************************************************
+ROOT_DISTANCE
+Arguments: const struct sntp_query *q: finished query
+Returns: worst case error of time taken from this server, seconds
+********************************************************************************/
+static double root_distance(const struct sntp_query *q){
+  const struct sntp_packet *r = &q->result.reply.pc;
+
+  return (short_seconds(r->rootDelay) + fabs(q->result.delay)) / 2 +
+    short_seconds(r->rootDispersion);
+}
+
+/********************************************************************************
+SAMPLE_SNAPSHOT
+Describes the server once synchronised to an upstream reply
+
+Arguments: const struct sntp_query *q: the chosen upstream's query
+           struct upstream_snapshot *snap: filled in, root_dispersion
+                                           is set by the caller
+           double *dispersion: dispersion at the time of the reply, seconds
+Returns: N/A
+********************************************************************************/
+static void sample_snapshot(const struct sntp_query *q,
+			    struct upstream_snapshot *snap, double *dispersion){
+  const struct sntp_packet *r = &q->result.reply.pc;
+
+  memset(snap, 0, sizeof(*snap));
+  snap->leap = r->head.flags >> 6; //pass on leap second warnings
+  snap->stratum = r->head.stratum + 1;
+  snap->precision = local_precision;
+  snap->reference_id = address_refid(&q->addr);
+  snap->root_delay = ntp_short(short_seconds(r->rootDelay) +
+			       fabs(q->result.delay));
+  snap->ref_sec = htonl(q->result.t4 >> 32);
+  snap->ref_frac = htonl(q->result.t4 & 0xffffffffU);
+  snap->offset = q->result.offset;
+  /*The local clock is served as it is, not corrected, so its offset from
+   *upstream is part of the error too*/
+  *dispersion = short_seconds(r->rootDispersion) +
+    ldexp(1.0, r->head.precision) + ldexp(1.0, local_precision) +
+    fabs(q->result.offset);
+  if (fabs(q->result.offset) > UPSTREAMMAXOFFSET){
+    snap->leap = LEAPALARM;
+  }
+}
+
+/********************************************************************************
+PUBLISH
+Copies a snapshot into the next ring slot and makes it current
+
+Arguments: const struct upstream_snapshot *snap: new values
+Returns: N/A
+********************************************************************************/
+static void publish(const struct upstream_snapshot *snap){
+  struct upstream_snapshot *slot;
+
+  slot = &ring->slot[ring->next++ % UPSTREAMSNAPSHOTS];
+  *slot = *snap;
+  atomic_store_explicit(&ring->current, slot, memory_order_release);
+}
+
+/********************************************************************************
+MONOTONIC_SECONDS
+Arguments: N/A
+Returns: CLOCK_MONOTONIC in seconds
+********************************************************************************/
+static double monotonic_seconds(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/********************************************************************************
+SYNC_MAIN
+The sync thread. Polls every upstream server at once, picks the reply
+with the smallest root distance, publishes a snapshot and sleeps until the
+next poll or until upstream_configure changes the servers.
+
+Arguments: void *arg: unused
+Returns: does not return
+********************************************************************************/
+static void *sync_main(void *arg){
+  struct upstream_server list[UPSTREAMMAX];
+  struct sntp_query q[UPSTREAMMAX];
+  struct sntp_loop loop;
+  struct upstream_snapshot snap, synced;
+  struct timespec deadline;
+  char address[INET6_ADDRSTRLEN];
+  double dispersion = 0, last_sync = 0, age;
+  int n, interval, i, best, have_sync = 0, was_best = -1;
+
+  pthread_mutex_lock(&sync_lock);
+  while (1){
+    n = nwanted;
+    memcpy(list, wanted, sizeof(list));
+    interval = poll_interval;
+    reconfigured = 0;
+    pthread_mutex_unlock(&sync_lock);
+
+    if (n == 0){
+      have_sync = 0;
+      was_best = -1;
+      local_snapshot(&snap);
+      publish(&snap);
+    } else{
+      sntpLoopInit(&loop);
+      for (i = 0; i < n; i++){
+	sntpLoopAdd(&loop, &q[i], list[i].host, list[i].port,
+		    UPSTREAMTIMEOUT, NULL, NULL);
+      }
+      sntpLoopRun(&loop);
+
+      best = -1;
+      for (i = 0; i < n; i++){
+	if (q[i].status != SNTP_OK ||
+	    (q[i].result.reply.pc.head.flags >> 6) == LEAPALARM ||
+	    q[i].result.reply.pc.head.stratum >= MAXSTRATUM){
+	  continue; //no answer, or upstream is not synchronised itself
+	}
+	if (best == -1 || root_distance(&q[i]) < root_distance(&q[best])){
+	  best = i;
+	}
+      }
+      if (best != -1){
+	sample_snapshot(&q[best], &synced, &dispersion);
+	last_sync = monotonic_seconds();
+	have_sync = 1;
+	if (best != was_best){
+	  inet_ntop(q[best].addr.ss_family,
+		    q[best].addr.ss_family == AF_INET6 ?
+		    (void *)&((struct sockaddr_in6 *)&q[best].addr)->sin6_addr :
+		    (void *)&((struct sockaddr_in *)&q[best].addr)->sin_addr,
+		    address, sizeof(address));
+	  printf("upstream: synchronised to %s (%s), stratum %d\n",
+		 list[best].host, address, synced.stratum);
+	  fflush(stdout);
+	}
+      } else if (was_best != -1){
+	printf("upstream: no usable reply\n");
+	fflush(stdout);
+      }
+      was_best = best;
+
+      if (have_sync){
+	snap = synced;
+	age = monotonic_seconds() - last_sync;
+	snap.root_dispersion = ntp_short(dispersion + PHI * age);
+	if (age > (double)UPSTREAMMAXAGE * interval){
+	  snap.leap = LEAPALARM;
+	}
+      } else{
+	unsynchronised_snapshot(&snap);
+      }
+      publish(&snap);
+    }
+
+    pthread_mutex_lock(&sync_lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += interval;
+    while (!reconfigured){
+      if (n == 0){
+	pthread_cond_wait(&sync_wake, &sync_lock); //nothing to poll
+      } else if (pthread_cond_timedwait(&sync_wake, &sync_lock,
+					&deadline) == ETIMEDOUT){
+	break;
+      }
+    }
+  }
+  return NULL;
+}
+
+/********************************************************************************
+UPSTREAM_START
+Sets up the snapshot ring and starts the sync thread. Call before forking
+anything that should see new snapshots.
+
+Arguments: const struct server_config *cfg: upstream servers and poll
+Returns: error handle
+********************************************************************************/
+int upstream_start(const struct server_config *cfg){
+  struct upstream_snapshot snap;
+  pthread_condattr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+  int rv;
+
+  ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED){
+    perror("upstream: mmap");
+    ring = NULL;
+    return 1;
+  }
+  local_precision = clock_precision();
+  if (cfg->nupstream == 0){
+    local_snapshot(&snap);
+  } else{
+    unsynchronised_snapshot(&snap);
+  }
+  publish(&snap);
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sync_wake, &attr);
+  pthread_condattr_destroy(&attr);
+  nwanted = cfg->nupstream;
+  memcpy(wanted, cfg->upstream, sizeof(wanted));
+  poll_interval = cfg->upstream_poll;
+
+  //signals are for the main loop, the thread starts with them all blocked
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  rv = pthread_create(&thread, NULL, sync_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rv != 0){
+    fprintf(stderr, "upstream: pthread_create: %s\n", strerror(rv));
+    return 1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/********************************************************************************
+UPSTREAM_CONFIGURE
+Gives the sync thread a new list of servers and polls them straight away
+
+Arguments: const struct server_config *cfg: upstream servers and poll
+Returns: N/A
+********************************************************************************/
+void upstream_configure(const struct server_config *cfg){
+  pthread_mutex_lock(&sync_lock);
+  nwanted = cfg->nupstream;
+  memcpy(wanted, cfg->upstream, sizeof(wanted));
+  poll_interval = cfg->upstream_poll;
+  reconfigured = 1;
+  pthread_cond_signal(&sync_wake);
+  pthread_mutex_unlock(&sync_lock);
+}
+
+/********************************************************************************
+UPSTREAM_CURRENT
+The per-packet path: one atomic load, no locks
+
+Arguments: N/A
+Returns: the current snapshot, valid for at least UPSTREAMSNAPSHOTS - 1
+         further publications
+********************************************************************************/
+const struct upstream_snapshot *upstream_current(void){
+  static struct upstream_snapshot fallback;
+
+  if (ring == NULL){
+    if (fallback.stratum == 0){
+      local_snapshot(&fallback); //upstream_start was never called
+    }
+    return &fallback;
+  }
+  return atomic_load_explicit(&ring->current, memory_order_acquire);
+}
+
+/********************************************************************************
+UPSTREAM_REPORT
+Prints the current snapshot
+
+Arguments: N/A
+Returns: N/A
+********************************************************************************/
+void upstream_report(void){
+  struct upstream_snapshot snap = *upstream_current();
+  unsigned char *id = (unsigned char *)&snap.reference_id;
+
+  if (snap.stratum <= 1){
+    printf("upstream: stratum %d, refid %.4s", snap.stratum, (char *)id);
+  } else{
+    printf("upstream: stratum %d, refid %u.%u.%u.%u, offset %+.6f s",
+	   snap.stratum, id[0], id[1], id[2], id[3], snap.offset);
+  }
+  printf(", leap %d, root delay %.6f s, root dispersion %.6f s\n",
+	 snap.leap, short_seconds(snap.root_delay),
+	 short_seconds(snap.root_dispersion));
+  fflush(stdout);
+}
@@ -0,0 +1,52 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include "config.h"
+
+/********************************************************************************
+UPSTREAM SYNCHRONISATION
+A background thread polls the configured upstream servers with the client
+library (../Luke/sntp_client.c) and works out what the server should claim
+about itself: stratum, reference id, root delay and dispersion, reference
+timestamp and leap indicator. Each result is published as an immutable
+snapshot by storing a single pointer, so the per-packet path reads it with
+one atomic load and never waits for the sync thread.
+
+Snapshots live in a ring in a shared mapping, so forked children and the
+broadcaster see new ones too. A slot is only rewritten after
+UPSTREAMSNAPSHOTS - 1 newer publications, at most one per poll or reload,
+which is the grace period for a reader still holding an old pointer;
+readers copy the fields straight away.
+
+With no upstream servers the snapshot describes the local clock at
+stratum 1. Until the first upstream answers, and whenever the local clock
+is more than UPSTREAMMAXOFFSET from upstream or upstream has not answered
+for UPSTREAMMAXAGE polls, the leap indicator is set to alarm.
+********************************************************************************/
+
+#define UPSTREAMSNAPSHOTS 16
+#define UPSTREAMTIMEOUT 2000     //ms to wait for each poll's replies
+#define UPSTREAMMAXOFFSET 0.128  //seconds, the clock is not stepped for us
+#define UPSTREAMMAXAGE 8         //polls without a usable reply
+#define LEAPALARM 3              //LI: clock not synchronised
+
+/*Everything but offset is in network order, ready to copy into a packet*/
+struct upstream_snapshot{
+  unsigned char leap;       //LI
+  unsigned char stratum;    //0 while unsynchronised ("INIT")
+  signed char precision;    //log2 seconds
+  uint32_t reference_id;
+  uint32_t root_delay;      //NTP short format
+  uint32_t root_dispersion;
+  uint32_t ref_sec;         //both 0 for the local clock: ref is the
+  uint32_t ref_frac;        //transmit time
+  double offset;            //upstream minus local clock, seconds
+};
+
+int upstream_start(const struct server_config *cfg);
+void upstream_configure(const struct server_config *cfg);
+const struct upstream_snapshot *upstream_current(void);
+void upstream_report(void);
+
+#endif
@@ -2,10 +2,22 @@
  *client-full.c - V1.0 - Author: Luke "Donghead" Parsons
  *Date: 22/11/2015 
  *Is the primary controller for the SNTP Program
+ *Command line wrapper over the client library (sntp_client.c, built as
+ *libsntp.a by comp.sh), which holds the request/decode logic
+ *
+ *Usage: ./client [-s state] host         - one unicast query
+ *       ./client -l address [-c server]  - listen for broadcast (mode 5)
+ *         packets sent to address (broadcast or multicast group), optionally
+ *         calibrating the network delay once with a unicast query to server
+ *       ./client -S targets [-j] [-r rate] [-w sockets] [-t ms]
+ *         - audit every server listed in targets (see sntp_scan.c), one
+ *         CSV (or with -j JSON) line per server
  *
  ********************************************************************************/
 #include <stdio.h>
-#include "sntp_structFuncs.h"
+#include "sntp_client.h"
+#include "sntp_state.h"
+#include "sntp_scan.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
@@ -26,43 +38,7 @@
 
 #define PORT_TALK "9100"
 #define PORT_NTP "123"
-
-/********************************************************************************
- *Clears or initialise packet*
- *Arguments: Pointer to Union containing
- *SNTP packet to be 0'd
- *Returns Void
- ********************************************************************************/
-void zeroPacket(union sntp_union *un)
-{
-  memset(un->bytes, 0, sizeof(un->bytes));
-}
-
-/********************************************************************************
- *BUILDS REQUEST PACKET TO SEND TO SERVER
- *arguments: Pointer to Union Containing Request packet
- *sets header to specified values (See below)
- *gets Time of day & sets transmit time just before Sending Packet
- *Returns Void
- ********************************************************************************/
-void buildReqPacket(union sntp_union *un)
-{
-  struct timeval tod;
-  gettimeofday(&tod, NULL);
-  printf("Current time(TIME SENT)");
-  print_tv(tod);
-  
-  //0010 0011 - Can use either method but simpler to just do this way
-  //pc->head->flags = 0x23; //LI(0), VN(4), mode(client=3)
-  un->bytes[0] = 0x23;
-
-  //tv_to_ntp provided by A-Scully24 Refer to externalReferences.c
-  //temp = tv_to_ntp(tod);
-  
-  un->pc.ts_transmit = tv_to_ntp(tod);
-  un->pc.ts_transmit = htobe64(un->pc.ts_transmit);
-  
-}
+#define STATE_FILE ".sntp_state" //in $HOME unless -s is given
 
 /********************************************************************************
  *PRINTS FORMATTED RAW PACKET DATA
@@ -120,111 +96,35 @@ void printRP(union sntp_union *un)
 }
 
 /********************************************************************************
- *PACKETDECODE - CONVERTS ENDIANS 
- *Arguments: Pointer to Union Containing SNTP packet to be decoded
- *Converts Endians in unsigned  
- *Return Void
- ********************************************************************************/
-void packetDecode(union sntp_union *un)
-{
-  un->pc.ts_ref = be64toh(un->pc.ts_ref);
-  un->pc.ts_org = be64toh(un->pc.ts_org);
-  un->pc.ts_rcv = be64toh(un->pc.ts_rcv);
-  un->pc.ts_transmit = be64toh(un->pc.ts_transmit);
-
-}
-
-/********************************************************************************
- *SOCKET HANDLER - Deals with Receiving and sending packet
- *IMPORTANT: for use with ntp.uwe.ac.uk, change PORT_TALK to PORT_NTP  
- *           for use with LISTENER, change PORT_NTP to PORT_TALK
- *Arguments: 1.Pointer to Union containing SNTP packet to send/receive 
- *2: pointer to argv[1] from main. When calling from main: sockethandler(&un, argv)
+ *SOCKET HANDLER - Sends a request and waits for the reply
+ *IMPORTANT: for use with ntp.uwe.ac.uk, use PORT_NTP
+ *           for use with LISTENER, use PORT_TALK
+ *Arguments: 1.Query to run, result is left in q->result
+ *2: Host to query. When calling from main: sockethandler(&q, argv[1], PORT_NTP, &st)
+ *3: Port to query
+ *4: Persisted state (sntp_state.c) used to pick the address and updated
+ *   with the outcome, or NULL
  *
- *First Sets up reference addrinfo to pass to getaddrinfo() which returns a list 
- *of structs that we cycle through to create the socket we'll talk on. Then sends 
- *the 48 bytes of request packet off to Destination Address passed on program call.
- *recvfrom() is a blocking call by default so it waits until it has received something
- *to continue. Could implement timeout function to return() after certain amount of time
- *but since we know that if the request is sent we'll receive a reply it shouldn't
- *Be a problem.
+ *Blocking wrapper over the library (sntp_client.c) for the command line:
+ *starts the query and waits up to SNTP_DEFAULT_TIMEOUT for the reply.
+ *Returns SNTP_OK or the library error code
  ********************************************************************************/
-int sockethandler(union sntp_union *un, char *argv[])
+int sockethandler(struct sntp_query *q, const char *host, const char *port,
+		  struct sntp_state *st)
 {
-  int mainSock, numBytes; 
-  struct addrinfo ref, *p_result, *p_ts;
-  struct sockaddr_storage their_addr;
-  int ai; //getaddrinfo() error var
-  socklen_t addr_len;
-  char* host;
+  int status;
 
-  host = argv[1];
-     
-  memset(&ref, 0, sizeof(ref));
-  ref.ai_family = AF_UNSPEC; //Allows for IPv4/IPv6
-  ref.ai_socktype = SOCK_DGRAM;
-  
-  printf("\n");
-  if((ai = getaddrinfo(host, PORT_NTP, &ref, &p_result))!= 0)
-    {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ai));
-      exit(1);
-    }
-
-  /*getaddrinfo returns a list of structs
-   *loop through and connect. might implement
-   *some kind of errorhandling here or optimization
-   *might not be necessary referencing both the man page
-   *and Beej's so trying to get the best of both*/
-  for(p_ts = p_result; p_ts != NULL; p_ts = p_ts->ai_next)
-    {
-      if ((mainSock = socket(p_ts->ai_family, p_ts->ai_socktype, p_ts->ai_protocol)) == -1)
-	{
-	  perror("Talker:Socket");
-	  continue;
-	}
-      else
-	printf("Created socket\n\n");
-      break;
-    }
-
-  if(p_ts == NULL)
-    {
-      fprintf(stderr, "Socket NULL\n");
-      return 2;
-    }
-
-  freeaddrinfo(p_result); //No longer needed ->Free up memory
-	       
-  printf("size of packet %lu\n", sizeof(un->bytes));
-
-  addr_len = sizeof their_addr;
-  if((numBytes = sendto(mainSock, un->bytes, sizeof(un->bytes), 0,
-			p_ts->ai_addr, p_ts->ai_addrlen)) == -1)
-    {
-      perror("Talker: sendto");
-      exit(1);
-    }
-  else
-    printf("Sent packet\n");
-  printf("Waiting for response...\n");
-
-
-  if((numBytes = recvfrom(mainSock,un->bytes , sizeof(un->bytes), 0,
-			  (struct sockaddr*)&their_addr , &addr_len)) == -1)
-    {
-      perror("Talker: rcv");
-      exit(1);
-    }
+  if(st != NULL && st->map != NULL)
+    status = sntpStateQueryStart(st, q, host, port, SNTP_DEFAULT_TIMEOUT);
   else
-    printf("Received Packet:\n");
-
-  printRP(un); //Print received Raw Packet
-  
-  packetDecode(un); //Convert endians
-  
-  return(1);
-     
+    status = sntpQueryStart(q, host, port, SNTP_DEFAULT_TIMEOUT);
+  if(status == SNTP_EAGAIN)
+    status = sntpQueryWait(q);
+  if(st != NULL)
+    sntpStateRecord(st, host, port, q);
+  if(status != SNTP_OK)
+    fprintf(stderr, "%s: %s\n", host, sntpStrerror(status));
+  return status;
 }
 
 /********************************************************************************
@@ -266,32 +166,221 @@ void printFormatTS(union sntp_union *un)
     putchar('\n');
 }
 
+/********************************************************************************
+ *LISTENBROADCAST - Broadcast client mode
+ *Arguments: 1: Broadcast address or multicast group the server sends to
+ *2: Round trip delay from a unicast calibration, or 0 if not calibrated
+ *
+ *Binds to PORT_TALK (joining the group if it is multicast) and prints the
+ *offset of every mode 5 packet received. Each packet only carries the
+ *server transmit time, so the offset is T3 + delay/2 - T4, with the one way
+ *delay assumed to be half the calibrated round trip. Never returns unless
+ *the socket can't be set up.
+ ********************************************************************************/
+int listenBroadcast(const char *group, double delay)
+{
+  int sock, numBytes, ai, on = 1;
+  struct addrinfo ref, *p_group, *p_bind;
+  struct sockaddr_storage their_addr;
+  socklen_t addr_len;
+  union sntp_union un;
+  u_int64_t t4;
+  int kernel;
+  char from[INET6_ADDRSTRLEN];
+
+  memset(&ref, 0, sizeof(ref));
+  ref.ai_family = AF_UNSPEC;
+  ref.ai_socktype = SOCK_DGRAM;
+  if((ai = getaddrinfo(group, PORT_TALK, &ref, &p_group)) != 0)
+    {
+      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ai));
+      return 2;
+    }
+
+  //Bind to the wildcard address of the same family as the group
+  ref.ai_family = p_group->ai_family;
+  ref.ai_flags = AI_PASSIVE;
+  if((ai = getaddrinfo(NULL, PORT_TALK, &ref, &p_bind)) != 0)
+    {
+      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ai));
+      freeaddrinfo(p_group);
+      return 2;
+    }
+  if((sock = socket(p_bind->ai_family, p_bind->ai_socktype, p_bind->ai_protocol)) == -1)
+    {
+      perror("Listener: socket");
+      freeaddrinfo(p_group);
+      freeaddrinfo(p_bind);
+      return 2;
+    }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)); //share with other listeners
+  if(bind(sock, p_bind->ai_addr, p_bind->ai_addrlen) == -1)
+    {
+      perror("Listener: bind");
+      close(sock);
+      freeaddrinfo(p_group);
+      freeaddrinfo(p_bind);
+      return 2;
+    }
+  freeaddrinfo(p_bind);
+
+  //Join the group if it is multicast, broadcast needs nothing extra
+  if(p_group->ai_family == AF_INET)
+    {
+      struct ip_mreq mreq;
+      mreq.imr_multiaddr = ((struct sockaddr_in *)p_group->ai_addr)->sin_addr;
+      mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+      if(IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr)) &&
+	 setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+	perror("Listener: IP_ADD_MEMBERSHIP");
+    }
+  else if(p_group->ai_family == AF_INET6)
+    {
+      struct ipv6_mreq mreq6;
+      mreq6.ipv6mr_multiaddr = ((struct sockaddr_in6 *)p_group->ai_addr)->sin6_addr;
+      mreq6.ipv6mr_interface = 0;
+      if(IN6_IS_ADDR_MULTICAST(&mreq6.ipv6mr_multiaddr) &&
+	 setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq6, sizeof(mreq6)) == -1)
+	perror("Listener: IPV6_JOIN_GROUP");
+    }
+  freeaddrinfo(p_group);
+  sntpEnableTimestamps(sock); //T4 from the kernel when possible
+
+  printf("Listening for broadcasts to %s (delay %.6f s)...\n", group, delay);
+  while(1)
+    {
+      addr_len = sizeof their_addr;
+      if((numBytes = sntpRecvStamped(sock, un.bytes, sizeof(un.bytes),
+				     &their_addr, &addr_len, &t4, &kernel)) == -1)
+	{
+	  perror("Listener: rcv");
+	  continue;
+	}
+      if(numBytes < (int)sizeof(un.bytes) || (un.bytes[0] & 0x07) != 5)
+	continue; //not a broadcast packet
+
+      packetDecode(&un);
+      inet_ntop(their_addr.ss_family,
+		their_addr.ss_family == AF_INET6 ?
+		(void *)&((struct sockaddr_in6 *)&their_addr)->sin6_addr :
+		(void *)&((struct sockaddr_in *)&their_addr)->sin_addr,
+		from, sizeof(from));
+      printf("%s stratum %u: offset %+.6f s\n", from, un.pc.head.stratum,
+	     ntpDiff(un.pc.ts_transmit, t4) + delay / 2);
+    }
+  return 0;
+}
+
 /********************************************************************************
  * Main - 
  ********************************************************************************/
 int main(int argc, char* argv[])
 {
-  union sntp_union unpc; //union packet
+  struct sntp_query q;
+  struct sntp_state st;
+  struct sntp_server_state known;
+  struct timeval tv;
+  double delay = 0;
+  struct scan_options scan;
+  char *group = NULL, *calibrate = NULL, *statePath = NULL, *targets = NULL;
+  char defaultPath[512];
+  int opt, warm;
+
+  scanDefaults(&scan, PORT_NTP);
+  while((opt = getopt(argc, argv, "l:c:s:S:jr:w:t:")) != -1)
+    {
+      switch(opt)
+	{
+	case 'S':
+	  targets = optarg;
+	  break;
+	case 'j':
+	  scan.format = SCAN_JSON;
+	  break;
+	case 'r':
+	  scan.rate = atoi(optarg) > 0 ? atoi(optarg) : SCAN_DEFAULT_RATE;
+	  break;
+	case 'w':
+	  scan.sockets = atoi(optarg) > 0 ? atoi(optarg) : SCAN_DEFAULT_SOCKETS;
+	  break;
+	case 't':
+	  scan.timeout_ms = atoi(optarg) > 0 ? atoi(optarg) : SCAN_DEFAULT_TIMEOUT;
+	  break;
+	case 's':
+	  statePath = optarg;
+	  break;
+	case 'l':
+	  group = optarg;
+	  break;
+	case 'c':
+	  calibrate = optarg;
+	  break;
+	default:
+	  group = targets = NULL;
+	  optind = argc + 1; //force usage message
+	  break;
+	}
+    }
 
-  if(argc != 2)
+  if(group == NULL && targets == NULL && argc - optind != 1)
     {
-      printf("\nUsage: ./client www.example.com OR 164.11.80.XX\n\n");
+      printf("\nUsage: ./client [-s statefile] www.example.com OR 164.11.80.XX\n");
+      printf("       ./client -l 224.0.1.1 [-c server] (broadcast listen)\n");
+      printf("       ./client -S targets [-j] [-r rate] [-w sockets] [-t ms] (fleet audit)\n\n");
       exit(1);
     }
-  
-  zeroPacket(&unpc);
-  printf("0 packet\n");
-  printRP(&unpc);
 
-  buildReqPacket(&unpc);
+  //The audit is stateless: thousands of servers would churn the state file
+  if(targets != NULL)
+    return scanTargets(targets, &scan);
+
+  //Warm start: what earlier runs learned about the servers
+  if(statePath == NULL && getenv("HOME") != NULL)
+    {
+      snprintf(defaultPath, sizeof(defaultPath), "%s/%s", getenv("HOME"), STATE_FILE);
+      statePath = defaultPath;
+    }
+  if(statePath == NULL || sntpStateOpen(&st, statePath) != 0)
+    st.map = NULL, st.fd = -1;
 
-  printf("Request packet to send:\n");
-  printRP(&unpc);
+  if(group != NULL)
+    {
+      if(calibrate != NULL)
+	{
+	  //One unicast exchange with the broadcasting server to measure delay
+	  if(sockethandler(&q, calibrate, PORT_TALK, &st) != SNTP_OK)
+	    exit(1);
+	  delay = q.result.delay;
+	  printf("Calibrated delay %.6f s (offset %+.6f s)\n", delay, q.result.offset);
+	}
+      return listenBroadcast(group, delay);
+    }
   
-  sockethandler(&unpc, argv);
+  warm = sntpStateLookup(&st, argv[optind], PORT_NTP, &known) == 0;
+  if(sockethandler(&q, argv[optind], PORT_NTP, &st) != SNTP_OK)
+    exit(1);
+  sntpStateClose(&st);
+
+  /*Nothing is printed until the exchange is over, so the measured round
+   *trip is the network's and not the terminal's*/
+  tv = ntp_to_tv(q.result.t1);
+  printf("Current time(TIME SENT)");
+  print_tv(tv);
+  printf("T1 from %s, T4 from %s\n",
+	 q.result.stamps & SNTP_KERNEL_T1 ? "kernel" : "clock_gettime",
+	 q.result.stamps & SNTP_KERNEL_T4 ? "kernel" : "clock_gettime");
+  printf("Request packet sent:\n");
+  printRP(&q.req);
+  printf("Received Packet:\n");
+  printRP(&q.result.raw); //Print received Raw Packet
 
   /*Now packet is ready to print out using ntp_to_tv*/
-  printFormatTS(&unpc);
+  printFormatTS(&q.result.reply);
+  printf("Offset: %+.6f s  Delay: %.6f s\n", q.result.offset, q.result.delay);
+  if(warm)
+    printf("Warm start: best delay %.6f s, predicted offset %+.6f s, reply %s\n",
+	   known.min_delay, sntpStatePredict(&known, q.result.t4),
+	   sntpStateTrusted(&known, &q.result) ? "trusted" : "not trusted (slow path)");
   putchar('\n');
   printf("Additional Information:\n");
   system("ntpq -c rl");
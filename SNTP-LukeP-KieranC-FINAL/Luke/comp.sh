@@ -1,5 +1,8 @@
 #!/usr/bin/bash
-if gcc -Wall client-full.c externResource.c -o client; then
+#libsntp.a is the embeddable client library, client is the CLI over it
+if gcc -Wall -c sntp_client.c sntp_state.c externResource.c &&
+   ar rcs libsntp.a sntp_client.o sntp_state.o externResource.o &&
+   gcc -Wall client-full.c sntp_scan.c -L. -lsntp -o client; then
     echo "Holy Shit it worked"
 else
     echo "Ahhh, close but no cigar"
@@ -0,0 +1,604 @@
+/********************************************************************************
+ *sntp_client.c - Embeddable SNTP client library
+ *Holds the request/decode logic that used to live in client-full.c plus a
+ *non blocking query API on top of it. See sntp_client.h for how to drive it.
+ *client-full.c is now a thin command line wrapper over this file.
+ ********************************************************************************/
+#include <stdio.h>
+#include "sntp_client.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#endif
+
+/********************************************************************************
+ *       DEFINITIONS
+ ********************************************************************************/
+
+#define NTP_FRAC 4294967296.0 //2^32, fraction units per second
+#define NTP_EPOCH 2208988800ULL //seconds from 1900 to 1970
+#define STAMP_CONTROL 256 //room for the timestamp control messages
+#define MODE_SERVER 4
+
+/********************************************************************************
+ *Clears or initialise packet*
+ *Arguments: Pointer to Union containing
+ *SNTP packet to be 0'd
+ *Returns Void
+ ********************************************************************************/
+void zeroPacket(union sntp_union *un)
+{
+  memset(un->bytes, 0, sizeof(un->bytes));
+}
+
+/********************************************************************************
+ *TIMESPECTONTP - converts a CLOCK_REALTIME reading (or a kernel timestamp)
+ *to a host order NTP timestamp, keeping the nanoseconds
+ ********************************************************************************/
+u_int64_t timespecToNtp(const struct timespec *ts)
+{
+  return (((u_int64_t)ts->tv_sec + NTP_EPOCH) << 32) |
+    (((u_int64_t)ts->tv_nsec << 32) / 1000000000ULL);
+}
+
+/********************************************************************************
+ *NTPNOW - current time of the client clock as a host order NTP timestamp
+ *Used whenever the kernel can't timestamp a packet for us
+ ********************************************************************************/
+static sntp_clock clockNow = NULL;
+static void *clockArg = NULL;
+
+u_int64_t ntpNow(void)
+{
+  struct timespec ts;
+
+  if(clockNow != NULL)
+    return clockNow(clockArg);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return timespecToNtp(&ts);
+}
+
+/********************************************************************************
+ *SNTPSETCLOCK - makes ntpNow() (T1 and T4) read a caller supplied clock,
+ *e.g. the simulator's virtual one. Kernel timestamps are still taken
+ *from the real clock, so only use this for packets that never touch a
+ *socket. NULL goes back to CLOCK_REALTIME.
+ ********************************************************************************/
+void sntpSetClock(sntp_clock now, void *arg)
+{
+  clockNow = now;
+  clockArg = arg;
+}
+
+/********************************************************************************
+ *SNTPENABLETIMESTAMPS - asks the kernel to timestamp packets on a socket
+ *Software TX timestamps are queued on the socket error queue as the packet
+ *leaves the stack, RX timestamps arrive as a control message with the
+ *packet, so neither includes any time spent in this process.
+ *Returns 1 if enabled, 0 if not supported (callers fall back to ntpNow)
+ ********************************************************************************/
+int sntpEnableTimestamps(int fd)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+    return 1;
+#endif
+  return 0;
+}
+
+/********************************************************************************
+ *SNTPENABLERXTIMESTAMPS - as sntpEnableTimestamps, RX stamps only
+ *For sockets whose owner never reads the error queue: unread TX stamps
+ *would keep POLLERR raised and take up the receive buffer.
+ *Returns 1 if enabled, 0 if not supported
+ ********************************************************************************/
+int sntpEnableRxTimestamps(int fd)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+    return 1;
+#endif
+  return 0;
+}
+
+/********************************************************************************
+ *STAMPFROMCONTROL - finds the software timestamp in a received message
+ *Returns 1 and sets *ntp if there was one
+ ********************************************************************************/
+static int stampFromControl(struct msghdr *msg, u_int64_t *ntp)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+  struct cmsghdr *cmsg;
+  struct scm_timestamping stamps;
+
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+	{
+	  memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+	  if(stamps.ts[0].tv_sec == 0 && stamps.ts[0].tv_nsec == 0)
+	    return 0;
+	  *ntp = timespecToNtp(&stamps.ts[0]); //[0] is the software stamp
+	  return 1;
+	}
+    }
+#endif
+  return 0;
+}
+
+/********************************************************************************
+ *SNTPRECVSTAMPED - recvfrom() that also returns the arrival time (T4)
+ *Arguments: socket, buffer, sender address (may be NULL), arrival time,
+ *and set to 1 if the arrival time came from the kernel rather than a
+ *clock_gettime() after the read
+ *Returns what recvmsg() returns
+ ********************************************************************************/
+ssize_t sntpRecvStamped(int fd, void *buf, size_t len,
+			struct sockaddr_storage *from, socklen_t *fromlen,
+			u_int64_t *t4, int *kernel)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  union
+  {
+    struct cmsghdr align;
+    char buf[STAMP_CONTROL];
+  } control;
+  ssize_t numBytes;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_name = from;
+  msg.msg_namelen = from != NULL ? *fromlen : 0;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  numBytes = recvmsg(fd, &msg, 0);
+  if(numBytes == -1)
+    return -1;
+  if(from != NULL)
+    *fromlen = msg.msg_namelen;
+  *kernel = stampFromControl(&msg, t4);
+  if(!*kernel)
+    *t4 = ntpNow();
+  return numBytes;
+}
+
+/********************************************************************************
+ *READTXSTAMP - collects the kernel transmit timestamp (T1) for the request
+ *from the error queue, if it has arrived. Also empties the queue so poll()
+ *stops reporting POLLERR.
+ ********************************************************************************/
+static void readTxStamp(struct sntp_query *q)
+{
+  struct msghdr msg;
+  union
+  {
+    struct cmsghdr align;
+    char buf[STAMP_CONTROL];
+  } control;
+  u_int64_t t1;
+
+  if(!q->tstamping)
+    return;
+  while(1)
+    {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      if(recvmsg(q->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+	break;
+      if(stampFromControl(&msg, &t1))
+	{
+	  q->t1 = t1;
+	  q->t1_kernel = 1;
+	}
+    }
+}
+
+/********************************************************************************
+ *BUILDS REQUEST PACKET TO SEND TO SERVER
+ *arguments: Pointer to Union Containing Request packet
+ *sets header to specified values (See below)
+ *gets Time of day & sets transmit time just before Sending Packet
+ *Returns the transmit time (T1) in host order. Nothing else may happen
+ *between this and the send, and nothing is printed here
+ ********************************************************************************/
+u_int64_t buildReqPacket(union sntp_union *un)
+{
+  u_int64_t t1;
+
+  //0010 0011 - Can use either method but simpler to just do this way
+  //pc->head->flags = 0x23; //LI(0), VN(4), mode(client=3)
+  un->bytes[0] = 0x23;
+
+  t1 = ntpNow();
+  un->pc.ts_transmit = htobe64(t1);
+  return t1;
+}
+
+/********************************************************************************
+ *PACKETDECODE - CONVERTS ENDIANS
+ *Arguments: Pointer to Union Containing SNTP packet to be decoded
+ *Converts Endians in unsigned
+ *Return Void
+ ********************************************************************************/
+void packetDecode(union sntp_union *un)
+{
+  un->pc.ts_ref = be64toh(un->pc.ts_ref);
+  un->pc.ts_org = be64toh(un->pc.ts_org);
+  un->pc.ts_rcv = be64toh(un->pc.ts_rcv);
+  un->pc.ts_transmit = be64toh(un->pc.ts_transmit);
+
+}
+
+/********************************************************************************
+ *NTPDIFF - difference between two NTP timestamps
+ *Arguments: two host order NTP timestamps
+ *Returns a - b in seconds. Done as a signed 64 bit subtraction first so no
+ *precision is lost to the double on large timestamps
+ ********************************************************************************/
+double ntpDiff(u_int64_t a, u_int64_t b)
+{
+  return (double)(int64_t)(a - b) / NTP_FRAC;
+}
+
+/********************************************************************************
+ *CALCOFFSETDELAY - RFC 4330 offset and round trip delay
+ *Arguments: Pointer to Union containing a decoded (host order) reply,
+ *the time the request left (T1) and the reply arrived (T4), and where to
+ *store the results. T1 is passed in rather than taken from ts_org so a
+ *kernel transmit timestamp can replace the one written into the request
+ *Delay  = (T4 - T1) - (T3 - T2)
+ *Offset = ((T2 - T1) + (T3 - T4)) / 2
+ *T2 - ts_rcv, T3 - ts_transmit
+ ********************************************************************************/
+void calcOffsetDelay(union sntp_union *un, u_int64_t t1, u_int64_t t4,
+		     double *offset, double *delay)
+{
+  *delay = ntpDiff(t4, t1) - ntpDiff(un->pc.ts_transmit, un->pc.ts_rcv);
+  *offset = (ntpDiff(un->pc.ts_rcv, t1) +
+	     ntpDiff(un->pc.ts_transmit, t4)) / 2;
+}
+
+/********************************************************************************
+ *MONOMS - CLOCK_MONOTONIC in milliseconds, for deadlines
+ ********************************************************************************/
+static u_int64_t monoMs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/********************************************************************************
+ *QUERYFINISH - closes the socket and records the final status
+ ********************************************************************************/
+static int queryFinish(struct sntp_query *q, int status)
+{
+  if(q->fd != -1)
+    {
+      close(q->fd);
+      q->fd = -1;
+    }
+  q->status = status;
+  return status;
+}
+
+/********************************************************************************
+ *SNTPQUERYSTARTADDR - Sends a request to an already resolved address
+ *Arguments: 1: Query to start (caller owned, contents overwritten)
+ *2/3: Server address and its length
+ *4: Milliseconds to wait for a reply
+ *Creates a non blocking socket connected to the server, so only replies
+ *from that address are ever seen, and sends the request. Kernel
+ *timestamping is switched on first so T1/T4 are taken in the stack.
+ *Returns SNTP_EAGAIN if the request is in flight, or an error code
+ ********************************************************************************/
+int sntpQueryStartAddr(struct sntp_query *q, const struct sockaddr *addr,
+		       socklen_t addrlen, int timeout_ms)
+{
+  memset(q, 0, sizeof(*q));
+  q->fd = -1;
+  if(addrlen > sizeof(q->addr))
+    return queryFinish(q, SNTP_ESOCKET);
+  memcpy(&q->addr, addr, addrlen);
+  q->addrlen = addrlen;
+
+  if((q->fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return queryFinish(q, SNTP_ESOCKET);
+  if(connect(q->fd, addr, addrlen) == -1)
+    return queryFinish(q, SNTP_ESOCKET);
+  q->tstamping = sntpEnableTimestamps(q->fd);
+
+  zeroPacket(&q->req);
+  q->t1 = buildReqPacket(&q->req);
+  if(send(q->fd, q->req.bytes, sizeof(q->req.bytes), 0) != sizeof(q->req.bytes))
+    return queryFinish(q, SNTP_ESEND);
+
+  q->deadline = monoMs() + timeout_ms;
+  q->status = SNTP_EAGAIN;
+  return SNTP_EAGAIN;
+}
+
+/********************************************************************************
+ *SNTPQUERYSTART - Resolves host and starts a query to the first address
+ *that a socket can be created for
+ *Arguments: 1: Query to start, 2/3: host and port, 4: timeout in ms
+ *Returns SNTP_EAGAIN if the request is in flight, or an error code
+ ********************************************************************************/
+int sntpQueryStart(struct sntp_query *q, const char *host, const char *port,
+		   int timeout_ms)
+{
+  struct addrinfo ref, *p_result, *p_ts;
+  int status = SNTP_ESOCKET;
+
+  memset(&ref, 0, sizeof(ref));
+  ref.ai_family = AF_UNSPEC; //Allows for IPv4/IPv6
+  ref.ai_socktype = SOCK_DGRAM;
+  if(getaddrinfo(host, port, &ref, &p_result) != 0)
+    {
+      memset(q, 0, sizeof(*q));
+      q->fd = -1;
+      return queryFinish(q, SNTP_ERESOLVE);
+    }
+
+  for(p_ts = p_result; p_ts != NULL; p_ts = p_ts->ai_next)
+    {
+      status = sntpQueryStartAddr(q, p_ts->ai_addr, p_ts->ai_addrlen, timeout_ms);
+      if(status != SNTP_ESOCKET)
+	break;
+    }
+  freeaddrinfo(p_result); //No longer needed ->Free up memory
+  return status;
+}
+
+/********************************************************************************
+ *SNTPQUERYFD - Socket to watch for input, -1 once the query has finished
+ ********************************************************************************/
+int sntpQueryFd(const struct sntp_query *q)
+{
+  return q->fd;
+}
+
+/********************************************************************************
+ *SNTPQUERYTIMEOUT - Milliseconds until sntpQueryProcess() must be called
+ *even if no input arrives. 0 if the query is already due or finished
+ ********************************************************************************/
+int sntpQueryTimeout(const struct sntp_query *q)
+{
+  u_int64_t now;
+
+  if(q->status != SNTP_EAGAIN)
+    return 0;
+  now = monoMs();
+  return now >= q->deadline ? 0 : (int)(q->deadline - now);
+}
+
+/********************************************************************************
+ *SNTPQUERYPROCESS - Reads any replies waiting and checks the deadline
+ *Never blocks. Replies whose originate timestamp does not match the request
+ *(late replies to an earlier query) are ignored.
+ *Returns SNTP_EAGAIN while still waiting, then SNTP_OK or an error code.
+ *Once finished the result is in q->result and the socket is closed.
+ ********************************************************************************/
+int sntpQueryProcess(struct sntp_query *q)
+{
+  union sntp_union un;
+  ssize_t numBytes;
+  u_int64_t t4;
+  int mode, t4_kernel;
+
+  if(q->status != SNTP_EAGAIN)
+    return q->status;
+
+  readTxStamp(q);
+  while(1)
+    {
+      numBytes = sntpRecvStamped(q->fd, un.bytes, sizeof(un.bytes),
+				 NULL, NULL, &t4, &t4_kernel);
+      if(numBytes == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    break;
+	  return queryFinish(q, SNTP_ERECV);
+	}
+      if(numBytes < (ssize_t)sizeof(un.bytes) || un.pc.ts_org != q->req.pc.ts_transmit)
+	continue; //not the reply to this request
+
+      mode = un.bytes[0] & 0x07;
+      if(mode != MODE_SERVER || un.pc.ts_transmit == 0)
+	return queryFinish(q, SNTP_EREPLY);
+      if(un.pc.head.stratum == 0)
+	return queryFinish(q, SNTP_EKOD);
+
+      readTxStamp(q); //in case it was queued after the reply
+      q->result.raw = un;
+      packetDecode(&un);
+      q->result.reply = un;
+      q->result.t1 = q->t1;
+      q->result.t4 = t4;
+      q->result.stamps = (q->t1_kernel ? SNTP_KERNEL_T1 : 0) |
+	(t4_kernel ? SNTP_KERNEL_T4 : 0);
+      calcOffsetDelay(&un, q->t1, t4, &q->result.offset, &q->result.delay);
+      return queryFinish(q, SNTP_OK);
+    }
+
+  if(monoMs() >= q->deadline)
+    return queryFinish(q, SNTP_ETIMEOUT);
+  return SNTP_EAGAIN;
+}
+
+/********************************************************************************
+ *SNTPQUERYWAIT - Blocks until a started query finishes
+ *Returns SNTP_OK or an error code
+ ********************************************************************************/
+int sntpQueryWait(struct sntp_query *q)
+{
+  struct pollfd pfd;
+
+  while(sntpQueryProcess(q) == SNTP_EAGAIN)
+    {
+      pfd.fd = q->fd;
+      pfd.events = POLLIN;
+      poll(&pfd, 1, sntpQueryTimeout(q));
+    }
+  return q->status;
+}
+
+/********************************************************************************
+ *SNTPQUERYCLOSE - Abandons a query that is still in flight
+ ********************************************************************************/
+void sntpQueryClose(struct sntp_query *q)
+{
+  if(q->status == SNTP_EAGAIN)
+    queryFinish(q, SNTP_ETIMEOUT);
+}
+
+/********************************************************************************
+ *SNTPSTRERROR - Describes a return code
+ ********************************************************************************/
+const char *sntpStrerror(int status)
+{
+  switch(status)
+    {
+    case SNTP_OK:
+      return "success";
+    case SNTP_EAGAIN:
+      return "in progress";
+    case SNTP_ERESOLVE:
+      return "could not resolve host";
+    case SNTP_ESOCKET:
+      return "could not create socket";
+    case SNTP_ESEND:
+      return "could not send request";
+    case SNTP_ERECV:
+      return "receive failed";
+    case SNTP_ETIMEOUT:
+      return "timed out";
+    case SNTP_EREPLY:
+      return "invalid reply";
+    case SNTP_EKOD:
+      return "kiss o' death from server";
+    default:
+      return "unknown error";
+    }
+}
+
+/********************************************************************************
+ *SNTPLOOPINIT - Empties a loop
+ ********************************************************************************/
+void sntpLoopInit(struct sntp_loop *loop)
+{
+  loop->head = NULL;
+  loop->active = 0;
+}
+
+/********************************************************************************
+ *SNTPLOOPADD - Starts a query and adds it to the loop
+ *cb is called from sntpLoopRunOnce() when the query finishes. The query
+ *must stay valid until then; it may be reused or freed inside cb.
+ *Returns SNTP_EAGAIN, or an error code (and cb is not called) if the query
+ *could not be started
+ ********************************************************************************/
+int sntpLoopAdd(struct sntp_loop *loop, struct sntp_query *q,
+		const char *host, const char *port, int timeout_ms,
+		sntp_callback cb, void *arg)
+{
+  int status = sntpQueryStart(q, host, port, timeout_ms);
+
+  if(status != SNTP_EAGAIN)
+    return status;
+  q->cb = cb;
+  q->arg = arg;
+  q->next = loop->head;
+  loop->head = q;
+  loop->active++;
+  return status;
+}
+
+/********************************************************************************
+ *SNTPLOOPRUNONCE - Waits up to max_wait_ms (-1 for as long as needed) for
+ *any query to make progress, then runs the callbacks of those that finished.
+ *Callbacks run after the loop's own bookkeeping so they may add queries.
+ *Returns the number of queries still in flight
+ ********************************************************************************/
+int sntpLoopRunOnce(struct sntp_loop *loop, int max_wait_ms)
+{
+  struct sntp_query *q, **link, *done = NULL, *next;
+  u_int64_t now;
+  int wait, i, n = loop->active;
+
+  if(n == 0)
+    return 0;
+  {
+    struct pollfd fds[n];
+
+    wait = max_wait_ms;
+    for(q = loop->head, i = 0; q != NULL; q = q->next, i++)
+      {
+	fds[i].fd = q->fd;
+	fds[i].events = POLLIN;
+	fds[i].revents = 0;
+	if(wait < 0 || sntpQueryTimeout(q) < wait)
+	  wait = sntpQueryTimeout(q);
+      }
+    poll(fds, n, wait);
+
+    now = monoMs();
+    link = &loop->head;
+    for(i = 0; (q = *link) != NULL; i++)
+      {
+	if((fds[i].revents || now >= q->deadline) &&
+	   sntpQueryProcess(q) != SNTP_EAGAIN)
+	  {
+	    *link = q->next; //unlink and queue the callback
+	    q->next = done;
+	    done = q;
+	    loop->active--;
+	  }
+	else
+	  link = &q->next;
+      }
+  }
+
+  for(q = done; q != NULL; q = next)
+    {
+      next = q->next;
+      if(q->cb != NULL)
+	q->cb(q, q->status, q->arg);
+    }
+  return loop->active;
+}
+
+/********************************************************************************
+ *SNTPLOOPRUN - Runs until every query (including any added by callbacks)
+ *has finished
+ ********************************************************************************/
+void sntpLoopRun(struct sntp_loop *loop)
+{
+  while(sntpLoopRunOnce(loop, -1) > 0);
+}
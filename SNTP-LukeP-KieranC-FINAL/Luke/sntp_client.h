@@ -0,0 +1,122 @@
+#ifndef SNTP_CLIENT_H
+#define SNTP_CLIENT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "sntp_structFuncs.h"
+
+/********************************************************************************
+ *sntp_client.h - Embeddable SNTP client library (libsntp.a)
+ *
+ *Nothing in the library prints or exits; every call returns one of the
+ *SNTP_* codes below. A query owns one non blocking UDP socket and can be
+ *driven three ways:
+ *  1. Event loop: watch sntpQueryFd() for input with sntpQueryTimeout() as
+ *     the timeout and call sntpQueryProcess() when either fires.
+ *  2. Callbacks: add any number of queries to a struct sntp_loop and call
+ *     sntpLoopRun() (or sntpLoopRunOnce() from your own loop).
+ *  3. C++20 coroutines: co_await sntp::query(loop, host) from sntp_coro.hpp.
+ *Queries are allocated by the caller, the library never mallocs.
+ *Host names are resolved with getaddrinfo() when the query is started,
+ *which blocks for non numeric hosts; use sntpQueryStartAddr() to avoid it.
+ ********************************************************************************/
+
+/*RETURN CODES*/
+#define SNTP_OK 0
+#define SNTP_EAGAIN 1          //still waiting for the reply
+#define SNTP_ERESOLVE -1       //getaddrinfo failed
+#define SNTP_ESOCKET -2        //could not create or connect the socket
+#define SNTP_ESEND -3          //sending the request failed
+#define SNTP_ERECV -4          //receiving failed (e.g. port unreachable)
+#define SNTP_ETIMEOUT -5       //no reply before the deadline
+#define SNTP_EREPLY -6         //reply was not a valid server reply
+#define SNTP_EKOD -7           //kiss o' death (stratum 0) from the server
+
+#define SNTP_DEFAULT_TIMEOUT 5000 //ms
+
+/*Replaces CLOCK_REALTIME as the client clock, see sntpSetClock()*/
+typedef u_int64_t (*sntp_clock)(void *arg);
+
+/*sntp_result.stamps bits: which timestamps the kernel took*/
+#define SNTP_KERNEL_T1 1 //software TX timestamp, else clock_gettime
+#define SNTP_KERNEL_T4 2 //software RX timestamp, else clock_gettime
+
+/*Result of a finished query, all timestamps host order NTP format*/
+struct sntp_result
+{
+  union sntp_union raw;   //reply as received (network order)
+  union sntp_union reply; //decoded reply packet
+  u_int64_t t1;           //request sent (client clock)
+  u_int64_t t4;           //reply received (client clock)
+  int stamps;             //SNTP_KERNEL_* bits
+  double offset;          //seconds, add to local clock
+  double delay;           //round trip seconds
+};
+
+struct sntp_query;
+typedef void (*sntp_callback)(struct sntp_query *q, int status, void *arg);
+
+struct sntp_query
+{
+  int fd;
+  int status;                   //SNTP_EAGAIN while in flight
+  struct sockaddr_storage addr; //server queried
+  socklen_t addrlen;
+  union sntp_union req;         //request as sent (network order)
+  u_int64_t t1;                 //replaced by the kernel TX stamp if any
+  int tstamping;                //SO_TIMESTAMPING is on
+  int t1_kernel;
+  u_int64_t deadline;           //CLOCK_MONOTONIC ms
+  struct sntp_result result;    //valid once status is SNTP_OK
+  sntp_callback cb;             //used by struct sntp_loop
+  void *arg;
+  struct sntp_query *next;
+};
+
+/*Runs many queries at once, calling each query's callback when it finishes*/
+struct sntp_loop
+{
+  struct sntp_query *head;
+  int active;
+};
+
+/*FUNCTION PROTO DECLARATION */
+
+/*Packet helpers*/
+void zeroPacket(union sntp_union *un);
+u_int64_t buildReqPacket(union sntp_union *un);
+void packetDecode(union sntp_union *un);
+double ntpDiff(u_int64_t a, u_int64_t b);
+void calcOffsetDelay(union sntp_union *un, u_int64_t t1, u_int64_t t4,
+		     double *offset, double *delay);
+u_int64_t timespecToNtp(const struct timespec *ts);
+u_int64_t ntpNow(void);
+void sntpSetClock(sntp_clock now, void *arg);
+int sntpEnableTimestamps(int fd);
+int sntpEnableRxTimestamps(int fd);
+ssize_t sntpRecvStamped(int fd, void *buf, size_t len,
+			struct sockaddr_storage *from, socklen_t *fromlen,
+			u_int64_t *t4, int *kernel);
+
+/*Single query*/
+int sntpQueryStart(struct sntp_query *q, const char *host, const char *port,
+		   int timeout_ms);
+int sntpQueryStartAddr(struct sntp_query *q, const struct sockaddr *addr,
+		       socklen_t addrlen, int timeout_ms);
+int sntpQueryFd(const struct sntp_query *q);
+int sntpQueryTimeout(const struct sntp_query *q);
+int sntpQueryProcess(struct sntp_query *q);
+int sntpQueryWait(struct sntp_query *q);
+void sntpQueryClose(struct sntp_query *q);
+const char *sntpStrerror(int status);
+
+/*Many queries with callbacks*/
+void sntpLoopInit(struct sntp_loop *loop);
+int sntpLoopAdd(struct sntp_loop *loop, struct sntp_query *q,
+		const char *host, const char *port, int timeout_ms,
+		sntp_callback cb, void *arg);
+int sntpLoopRunOnce(struct sntp_loop *loop, int max_wait_ms);
+void sntpLoopRun(struct sntp_loop *loop);
+
+#endif
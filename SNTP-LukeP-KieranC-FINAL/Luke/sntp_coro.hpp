@@ -0,0 +1,76 @@
+#ifndef SNTP_CORO_HPP
+#define SNTP_CORO_HPP
+
+/********************************************************************************
+ *sntp_coro.hpp - C++20 coroutine front end for the client library
+ *
+ *    sntp_loop loop;
+ *    sntpLoopInit(&loop);
+ *    ...inside a coroutine...
+ *    sntp::outcome r = co_await sntp::query(loop, "pool.ntp.org");
+ *    if(r.status == SNTP_OK) use(r.result.offset);
+ *
+ *The awaiting coroutine is resumed from sntpLoopRunOnce()/sntpLoopRun(), so
+ *whoever owns the loop decides which thread coroutines run on. Header only,
+ *link against libsntp.a as usual.
+ ********************************************************************************/
+
+#include <coroutine>
+
+extern "C" {
+#include "sntp_client.h"
+}
+
+namespace sntp
+{
+  struct outcome
+  {
+    int status;                //SNTP_OK or an SNTP_E* code
+    struct sntp_result result; //valid if status == SNTP_OK
+  };
+
+  class query_awaitable
+  {
+  public:
+    query_awaitable(sntp_loop &loop, const char *host, const char *port,
+		    int timeout_ms)
+      : loop_(loop), host_(host), port_(port), timeout_(timeout_ms) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    //Returns false (resume straight away) if the query could not start
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+      handle_ = h;
+      status_ = sntpLoopAdd(&loop_, &q_, host_, port_, timeout_, &done, this);
+      return status_ == SNTP_EAGAIN;
+    }
+
+    outcome await_resume() const { return outcome{status_, q_.result}; }
+
+  private:
+    static void done(struct sntp_query *, int status, void *arg)
+    {
+      query_awaitable *self = static_cast<query_awaitable *>(arg);
+      self->status_ = status;
+      self->handle_.resume();
+    }
+
+    sntp_loop &loop_;
+    const char *host_;
+    const char *port_;
+    int timeout_;
+    int status_ = SNTP_EAGAIN;
+    struct sntp_query q_;
+    std::coroutine_handle<> handle_;
+  };
+
+  inline query_awaitable query(sntp_loop &loop, const char *host,
+			       const char *port = "123",
+			       int timeout_ms = SNTP_DEFAULT_TIMEOUT)
+  {
+    return query_awaitable(loop, host, port, timeout_ms);
+  }
+}
+
+#endif
@@ -0,0 +1,517 @@
+/********************************************************************************
+ *sntp_scan.c - Fleet audit mode (./client -S targets)
+ *
+ *Reads "host [port]" lines from a file, then sends one request per target
+ *from a handful of shared non blocking sockets, never faster than the rate
+ *cap, while reading replies as they come in. Every request carries a
+ *distinct transmit timestamp; the server echoes it as the originate
+ *timestamp, so a hash table on that value finds the target a reply belongs
+ *to, and the reply's source address must also match the target.
+ *One line per target (CSV or JSON) is written as soon as it is answered or
+ *times out, so results stream while the scan is running.
+ ********************************************************************************/
+#include <stdio.h>
+#include "sntp_client.h"
+#include "sntp_scan.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <netdb.h>
+
+/********************************************************************************
+ *       DEFINITIONS
+ ********************************************************************************/
+
+#define SCAN_HOSTLEN 256
+#define SCAN_MAXSOCKETS 64      //per address family
+#define SCAN_RCVBUF (4 << 20)   //room for replies that arrive in a burst
+#define SCAN_BURST_DIVISOR 100  //token bucket holds 10ms worth of packets
+#define SCAN_SEND_BACKOFF 1000000ULL //ns to wait after a full socket buffer
+
+#define T_UNSENT 0
+#define T_PENDING 1
+#define T_DONE 2
+
+struct scan_target
+{
+  char host[SCAN_HOSTLEN];
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  u_int64_t t1;       //transmit timestamp sent, also the hash key
+  u_int64_t deadline; //CLOCK_MONOTONIC ns
+  int state;
+};
+
+struct scan_run
+{
+  const struct scan_options *opt;
+  struct scan_target *tg;
+  int n;
+  int *table;         //open addressing, t1 -> target index, -1 empty
+  unsigned int mask;
+  int socks[2][SCAN_MAXSOCKETS]; //[0] IPv4, [1] IPv6
+  int nsocks[2];
+  int rr;             //round robin position
+  int done, ok, timeouts, other;
+};
+
+/********************************************************************************
+ *MONONS - CLOCK_MONOTONIC in nanoseconds
+ ********************************************************************************/
+static u_int64_t monoNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************************************
+ *SCANDEFAULTS - fills in the default options
+ ********************************************************************************/
+void scanDefaults(struct scan_options *opt, const char *port)
+{
+  opt->port = port;
+  opt->format = SCAN_CSV;
+  opt->sockets = SCAN_DEFAULT_SOCKETS;
+  opt->rate = SCAN_DEFAULT_RATE;
+  opt->timeout_ms = SCAN_DEFAULT_TIMEOUT;
+}
+
+/********************************************************************************
+ *TABLE HELPERS - the transmit timestamp hash table
+ ********************************************************************************/
+static unsigned int tableSlot(const struct scan_run *run, u_int64_t key)
+{
+  return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & run->mask;
+}
+
+static void tableInsert(struct scan_run *run, int idx)
+{
+  unsigned int i = tableSlot(run, run->tg[idx].t1);
+
+  while(run->table[i] != -1)
+    i = (i + 1) & run->mask;
+  run->table[i] = idx;
+}
+
+static int tableFind(const struct scan_run *run, u_int64_t key)
+{
+  unsigned int i = tableSlot(run, key);
+
+  while(run->table[i] != -1)
+    {
+      if(run->tg[run->table[i]].t1 == key)
+	return run->table[i];
+      i = (i + 1) & run->mask;
+    }
+  return -1;
+}
+
+/********************************************************************************
+ *SAMEADDR - whether a reply came from the address the target was sent to
+ ********************************************************************************/
+static int sameAddr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+  if(a->ss_family != b->ss_family)
+    return 0;
+  if(a->ss_family == AF_INET)
+    {
+      const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+      const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+      return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+  const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+  const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+  return x->sin6_port == y->sin6_port &&
+    memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+}
+
+/********************************************************************************
+ *PRINTJSONSTRING - writes s as a JSON string
+ ********************************************************************************/
+static void printJsonString(const char *s)
+{
+  putchar('"');
+  for(; *s; s++)
+    {
+      if(*s == '"' || *s == '\\')
+	putchar('\\');
+      if((unsigned char)*s >= 0x20)
+	putchar(*s);
+    }
+  putchar('"');
+}
+
+/********************************************************************************
+ *PRINTCSVFIELD - writes s as a CSV field, quoted (RFC 4180) if it holds a
+ *comma, quote or line break
+ ********************************************************************************/
+static void printCsvField(const char *s)
+{
+  if(strpbrk(s, ",\"\r\n") == NULL)
+    {
+      fputs(s, stdout);
+      return;
+    }
+  putchar('"');
+  for(; *s; s++)
+    {
+      if(*s == '"')
+	putchar('"');
+      putchar(*s);
+    }
+  putchar('"');
+}
+
+/********************************************************************************
+ *EMIT - writes one target's result line
+ *Arguments: run, target, status word, decoded reply (NULL if none),
+ *offset and delay
+ ********************************************************************************/
+static void emit(struct scan_run *run, struct scan_target *t, const char *status,
+		 const union sntp_union *un, double offset, double delay)
+{
+  char address[INET6_ADDRSTRLEN] = "";
+  char refid[INET6_ADDRSTRLEN] = "";
+  const unsigned char *ri;
+  int i;
+
+  if(t->addrlen != 0)
+    inet_ntop(t->addr.ss_family,
+	      t->addr.ss_family == AF_INET6 ?
+	      (void *)&((struct sockaddr_in6 *)&t->addr)->sin6_addr :
+	      (void *)&((struct sockaddr_in *)&t->addr)->sin_addr,
+	      address, sizeof(address));
+  if(un != NULL)
+    {
+      ri = (const unsigned char *)&un->pc.RI;
+      if(un->pc.head.stratum <= 1)
+	{
+	  //stratum 0/1: four ASCII characters (kiss code or clock source)
+	  for(i = 0; i < 4 && ri[i] >= 0x20 && ri[i] < 0x7f && ri[i] != '"' &&
+		ri[i] != '\\' && ri[i] != ','; i++)
+	    refid[i] = ri[i];
+	  refid[i] = '\0';
+	}
+      else
+	snprintf(refid, sizeof(refid), "%u.%u.%u.%u", ri[0], ri[1], ri[2], ri[3]);
+    }
+
+  if(run->opt->format == SCAN_JSON)
+    {
+      printf("{\"host\":");
+      printJsonString(t->host);
+      printf(",\"address\":\"%s\",\"status\":\"%s\"", address, status);
+      if(un != NULL)
+	printf(",\"stratum\":%u,\"refid\":\"%s\"", un->pc.head.stratum, refid);
+      if(un != NULL && strcmp(status, "ok") == 0)
+	printf(",\"offset\":%.9f,\"delay\":%.9f", offset, delay);
+      printf("}\n");
+    }
+  else
+    {
+      printCsvField(t->host);
+      printf(",%s,%s,", address, status);
+      if(un != NULL)
+	printf("%u,%s,", un->pc.head.stratum, refid);
+      else
+	printf(",,");
+      if(un != NULL && strcmp(status, "ok") == 0)
+	printf("%.9f,%.9f\n", offset, delay);
+      else
+	printf(",\n");
+    }
+
+  t->state = T_DONE;
+  run->done++;
+  if(strcmp(status, "ok") == 0)
+    run->ok++;
+  else if(strcmp(status, "timeout") == 0)
+    run->timeouts++;
+  else
+    run->other++;
+}
+
+/********************************************************************************
+ *LOADTARGETS - reads and resolves the target file
+ *Targets that don't resolve are reported straight away.
+ *Returns 0, or -1 if the file can't be read
+ ********************************************************************************/
+static int loadTargets(struct scan_run *run, const char *path)
+{
+  FILE *fp;
+  char line[SCAN_HOSTLEN + 64], host[SCAN_HOSTLEN], port[64];
+  struct addrinfo ref, *res;
+  struct scan_target *t;
+  int cap = 0, fields;
+
+  if((fp = fopen(path, "r")) == NULL)
+    {
+      perror(path);
+      return -1;
+    }
+  memset(&ref, 0, sizeof(ref));
+  ref.ai_family = AF_UNSPEC;
+  ref.ai_socktype = SOCK_DGRAM;
+
+  while(fgets(line, sizeof(line), fp) != NULL)
+    {
+      line[strcspn(line, "#\r\n")] = '\0';
+      fields = sscanf(line, "%255s %63s", host, port);
+      if(fields <= 0)
+	continue;
+      if(fields == 1)
+	snprintf(port, sizeof(port), "%s", run->opt->port);
+
+      if(run->n == cap)
+	{
+	  cap = cap ? cap * 2 : 1024;
+	  if((t = realloc(run->tg, cap * sizeof(*t))) == NULL)
+	    {
+	      fclose(fp);
+	      return -1;
+	    }
+	  run->tg = t;
+	}
+      t = &run->tg[run->n++];
+      memset(t, 0, sizeof(*t));
+      snprintf(t->host, sizeof(t->host), "%s", host);
+
+      //numeric addresses skip any DNS lookup
+      ref.ai_flags = AI_NUMERICHOST;
+      if(getaddrinfo(host, port, &ref, &res) != 0)
+	{
+	  ref.ai_flags = 0;
+	  if(getaddrinfo(host, port, &ref, &res) != 0)
+	    {
+	      emit(run, t, "resolve", NULL, 0, 0);
+	      continue;
+	    }
+	}
+      memcpy(&t->addr, res->ai_addr, res->ai_addrlen);
+      t->addrlen = res->ai_addrlen;
+      freeaddrinfo(res);
+    }
+  fclose(fp);
+  return 0;
+}
+
+/********************************************************************************
+ *OPENSOCKETS - opens the shared sockets for one address family
+ *Returns 0, or -1 if none could be opened
+ ********************************************************************************/
+static int openSockets(struct scan_run *run, int fam)
+{
+  int i, fd, buf = SCAN_RCVBUF;
+
+  for(i = 0; i < run->opt->sockets && i < SCAN_MAXSOCKETS; i++)
+    {
+      fd = socket(fam == 0 ? AF_INET : AF_INET6,
+		  SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if(fd == -1)
+	break;
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+      sntpEnableRxTimestamps(fd); //kernel RX stamps for T4; T1 is buildReqPacket's
+      run->socks[fam][run->nsocks[fam]++] = fd;
+    }
+  return run->nsocks[fam] > 0 ? 0 : -1;
+}
+
+/********************************************************************************
+ *SENDTARGET - sends one target's request
+ *Returns 0 if sent (or failed for good), 1 if the socket is full and the
+ *send should be retried later
+ ********************************************************************************/
+static int sendTarget(struct scan_run *run, struct scan_target *t, u_int64_t *lastT1)
+{
+  union sntp_union un;
+  int fam = t->addr.ss_family == AF_INET6 ? 1 : 0;
+  int fd;
+
+  if(run->nsocks[fam] == 0 && openSockets(run, fam) != 0)
+    {
+      emit(run, t, "socket", NULL, 0, 0);
+      return 0;
+    }
+  fd = run->socks[fam][run->rr++ % run->nsocks[fam]];
+
+  zeroPacket(&un);
+  t->t1 = buildReqPacket(&un);
+  if(t->t1 <= *lastT1)
+    {
+      t->t1 = *lastT1 + 1; //every request needs its own key
+      un.pc.ts_transmit = htobe64(t->t1);
+    }
+  if(sendto(fd, un.bytes, sizeof(un.bytes), 0,
+	    (struct sockaddr *)&t->addr, t->addrlen) == -1)
+    {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+	return 1;
+      emit(run, t, "send", NULL, 0, 0);
+      return 0;
+    }
+  *lastT1 = t->t1;
+  t->deadline = monoNs() + (u_int64_t)run->opt->timeout_ms * 1000000ULL;
+  t->state = T_PENDING;
+  tableInsert(run, t - run->tg);
+  return 0;
+}
+
+/********************************************************************************
+ *READREPLIES - drains one socket, matching each reply to its target
+ ********************************************************************************/
+static void readReplies(struct scan_run *run, int fd)
+{
+  union sntp_union un;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct scan_target *t;
+  ssize_t numBytes;
+  u_int64_t t4;
+  double offset, delay;
+  int idx, kernel;
+
+  while(1)
+    {
+      fromlen = sizeof(from);
+      numBytes = sntpRecvStamped(fd, un.bytes, sizeof(un.bytes), &from, &fromlen,
+				 &t4, &kernel);
+      if(numBytes == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  return; //EAGAIN, or an ICMP error nothing can be matched to
+	}
+      if(numBytes < (ssize_t)sizeof(un.bytes))
+	continue;
+      idx = tableFind(run, be64toh(un.pc.ts_org));
+      if(idx == -1)
+	continue; //not ours
+      t = &run->tg[idx];
+      if(t->state != T_PENDING || !sameAddr(&from, &t->addr))
+	continue; //duplicate, late, or spoofed
+
+      packetDecode(&un);
+      if((un.bytes[0] & 0x07) != 4 || //mode 4, server
+	  un.pc.ts_transmit == 0)
+	emit(run, t, "badreply", &un, 0, 0);
+      else if(un.pc.head.stratum == 0)
+	emit(run, t, "kod", &un, 0, 0);
+      else
+	{
+	  calcOffsetDelay(&un, t->t1, t4, &offset, &delay);
+	  emit(run, t, "ok", &un, offset, delay);
+	}
+    }
+}
+
+/********************************************************************************
+ *SCANTARGETS - runs a whole scan
+ *Arguments: target file, options
+ *Returns 0 once every target has a result line, 1 on setup errors
+ ********************************************************************************/
+int scanTargets(const char *path, const struct scan_options *opt)
+{
+  struct scan_run run;
+  struct pollfd *pfds;
+  u_int64_t now, start, last, lastT1 = 0, wait;
+  double tokens, burst;
+  int next = 0, oldest = 0, size, i, fam, npfds, timeout, blocked;
+
+  memset(&run, 0, sizeof(run));
+  run.opt = opt;
+  if(opt->format == SCAN_CSV)
+    printf("host,address,status,stratum,refid,offset,delay\n");
+  if(loadTargets(&run, path) != 0)
+    return 1;
+  for(size = 16; size < run.n * 2; size <<= 1);
+  run.mask = size - 1;
+  run.table = malloc(size * sizeof(int));
+  pfds = malloc(2 * SCAN_MAXSOCKETS * sizeof(*pfds));
+  if(run.table == NULL || pfds == NULL)
+    return 1;
+  memset(run.table, -1, size * sizeof(int));
+
+  burst = opt->rate / SCAN_BURST_DIVISOR + 1;
+  tokens = burst;
+  start = last = monoNs();
+  while(run.done < run.n)
+    {
+      //send while the rate cap allows
+      now = monoNs();
+      tokens += (double)(now - last) * opt->rate / 1e9;
+      if(tokens > burst)
+	tokens = burst;
+      last = now;
+      blocked = 0;
+      while(next < run.n && tokens >= 1)
+	{
+	  if(run.tg[next].state != T_UNSENT)
+	    {
+	      next++; //already failed to resolve
+	      continue;
+	    }
+	  if(sendTarget(&run, &run.tg[next], &lastT1) != 0)
+	    {
+	      blocked = 1; //socket buffers full, try again after reading
+	      break;
+	    }
+	  next++;
+	  tokens--;
+	}
+
+      //targets are sent in order, so deadlines expire in order too
+      now = monoNs();
+      while(oldest < next && (run.tg[oldest].state != T_PENDING ||
+			      run.tg[oldest].deadline <= now))
+	{
+	  if(run.tg[oldest].state == T_PENDING)
+	    emit(&run, &run.tg[oldest], "timeout", NULL, 0, 0);
+	  oldest++;
+	}
+      if(run.done == run.n)
+	break;
+
+      //wait for replies, the next token, or the next deadline
+      wait = 1000000000ULL;
+      if(blocked)
+	wait = SCAN_SEND_BACKOFF; //tokens are left, but sending now would spin
+      else if(next < run.n)
+	wait = tokens >= 1 ? 0 : (u_int64_t)((1 - tokens) * 1e9 / opt->rate) + 1;
+      if(oldest < next && run.tg[oldest].deadline - now < wait)
+	wait = run.tg[oldest].deadline - now;
+      timeout = (int)((wait + 999999) / 1000000);
+
+      npfds = 0;
+      for(fam = 0; fam < 2; fam++)
+	for(i = 0; i < run.nsocks[fam]; i++)
+	  {
+	    pfds[npfds].fd = run.socks[fam][i];
+	    pfds[npfds].events = POLLIN;
+	    pfds[npfds++].revents = 0;
+	  }
+      if(poll(pfds, npfds, timeout) > 0)
+	for(i = 0; i < npfds; i++)
+	  if(pfds[i].revents)
+	    readReplies(&run, pfds[i].fd);
+      fflush(stdout);
+    }
+
+  fflush(stdout);
+  fprintf(stderr, "scan: %d targets, %d ok, %d timed out, %d other, %.3f s\n",
+	  run.n, run.ok, run.timeouts, run.other, (monoNs() - start) / 1e9);
+  for(fam = 0; fam < 2; fam++)
+    for(i = 0; i < run.nsocks[fam]; i++)
+      close(run.socks[fam][i]);
+  free(pfds);
+  free(run.table);
+  free(run.tg);
+  return 0;
+}
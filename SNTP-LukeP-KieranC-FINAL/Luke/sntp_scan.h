@@ -0,0 +1,29 @@
+#ifndef SNTP_SCAN_H
+#define SNTP_SCAN_H
+
+/********************************************************************************
+ *sntp_scan.h - Fleet audit mode
+ *Queries every server in a target file with thousands of requests in
+ *flight from a few shared sockets, streaming one result line per target.
+ ********************************************************************************/
+
+#define SCAN_CSV 0
+#define SCAN_JSON 1 //one JSON object per line
+
+#define SCAN_DEFAULT_SOCKETS 4
+#define SCAN_DEFAULT_RATE 10000   //packets per second
+#define SCAN_DEFAULT_TIMEOUT 2000 //ms
+
+struct scan_options
+{
+  const char *port;   //used when a target line has no port
+  int format;         //SCAN_CSV or SCAN_JSON
+  int sockets;        //sockets per address family
+  int rate;           //global packet rate cap
+  int timeout_ms;     //per target
+};
+
+void scanDefaults(struct scan_options *opt, const char *port);
+int scanTargets(const char *path, const struct scan_options *opt);
+
+#endif
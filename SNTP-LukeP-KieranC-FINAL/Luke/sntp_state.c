@@ -0,0 +1,463 @@
+/********************************************************************************
+ *sntp_state.c - Persisted client state for warm starts
+ *See sntp_state.h for the file layout and how updates stay crash safe.
+ ********************************************************************************/
+#include <stdio.h>
+#include "sntp_state.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+/********************************************************************************
+ *       DEFINITIONS
+ ********************************************************************************/
+
+#define MAX_CANDIDATES 16   //resolved addresses considered per query
+#define FREQ_MIN_INTERVAL 16.0 //seconds between offsets before estimating drift
+#define FREQ_WEIGHT 0.25    //weight of a new drift estimate
+#define TRUST_SLACK 0.001   //seconds of extra delay still trusted
+
+/********************************************************************************
+ *FNV32 - FNV-1a hash, used for the record checksums and for placing hosts
+ ********************************************************************************/
+static u_int32_t fnv32(const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  u_int32_t h = 2166136261U;
+
+  while(len--)
+    {
+      h ^= *p++;
+      h *= 16777619U;
+    }
+  return h;
+}
+
+/********************************************************************************
+ *RECORDCHECKSUM - checksum of a record copy, excluding the checksum itself
+ ********************************************************************************/
+static u_int32_t recordChecksum(const struct sntp_server_state *s)
+{
+  return fnv32(s, offsetof(struct sntp_server_state, checksum));
+}
+
+/********************************************************************************
+ *CURRENTCOPY - the newer of a server's two record copies that is intact
+ *Returns NULL if neither is
+ ********************************************************************************/
+static const struct sntp_server_state *currentCopy(const struct sntp_server_state *pair)
+{
+  const struct sntp_server_state *best = NULL;
+  int i;
+
+  for(i = 0; i < 2; i++)
+    {
+      if(pair[i].gen == 0 || pair[i].checksum != recordChecksum(&pair[i]))
+	continue;
+      if(best == NULL || pair[i].gen > best->gen)
+	best = &pair[i];
+    }
+  return best;
+}
+
+/********************************************************************************
+ *LOCKSTATE - takes or drops the whole file lock
+ ********************************************************************************/
+static void lockState(struct sntp_state *st, int type)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  while(fcntl(st->fd, F_SETLKW, &fl) == -1 && errno == EINTR);
+}
+
+/********************************************************************************
+ *SERVERKEY - the name a server's record is kept under
+ *A host and port together: the same host on another port may be another
+ *server, with its own clock and delays.
+ *Returns 0, or -1 if the key doesn't fit: a truncated key could match a
+ *different server, so such servers are simply not remembered
+ ********************************************************************************/
+static int serverKey(char *key, const char *host, const char *port)
+{
+  int n = snprintf(key, SNTP_STATE_HOSTLEN, "%s/%s", host, port);
+
+  return n >= 0 && n < SNTP_STATE_HOSTLEN ? 0 : -1;
+}
+
+/********************************************************************************
+ *FINDSERVER - slot index for a server key
+ *Linear probe from the key's hash. If create is set and the key isn't
+ *there, returns the first free slot, or evicts the hashed slot when full.
+ *Returns -1 if not found and create is 0
+ ********************************************************************************/
+static int findServer(struct sntp_state *st, const char *key, int create)
+{
+  const struct sntp_server_state *s;
+  int start, i, idx, freeIdx = -1;
+
+  start = fnv32(key, strlen(key)) % SNTP_STATE_SERVERS;
+  for(i = 0; i < SNTP_STATE_SERVERS; i++)
+    {
+      idx = (start + i) % SNTP_STATE_SERVERS;
+      s = currentCopy(st->map->slot[idx]);
+      if(s == NULL)
+	{
+	  if(freeIdx == -1)
+	    freeIdx = idx;
+	  continue;
+	}
+      if(strncmp(s->host, key, SNTP_STATE_HOSTLEN) == 0)
+	return idx;
+    }
+  if(!create)
+    return -1;
+  return freeIdx != -1 ? freeIdx : start;
+}
+
+/********************************************************************************
+ *ADDRSET / ADDRGET / ADDRFIND - convert between sockaddrs and the compact
+ *stored form
+ ********************************************************************************/
+static void addrSet(struct sntp_addr_stat *a, const struct sockaddr_storage *ss)
+{
+  memset(a, 0, sizeof(*a));
+  a->family = ss->ss_family;
+  if(ss->ss_family == AF_INET)
+    {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+      a->port = sin->sin_port;
+      memcpy(a->ip, &sin->sin_addr, 4);
+    }
+  else
+    {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+      a->port = sin6->sin6_port;
+      memcpy(a->ip, &sin6->sin6_addr, 16);
+    }
+}
+
+static socklen_t addrGet(const struct sntp_addr_stat *a, struct sockaddr_storage *ss)
+{
+  memset(ss, 0, sizeof(*ss));
+  if(a->family == AF_INET)
+    {
+      struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+      sin->sin_family = AF_INET;
+      sin->sin_port = a->port;
+      memcpy(&sin->sin_addr, a->ip, 4);
+      return sizeof(*sin);
+    }
+  else
+    {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = a->port;
+      memcpy(&sin6->sin6_addr, a->ip, 16);
+      return sizeof(*sin6);
+    }
+}
+
+static const struct sntp_addr_stat *addrFind(const struct sntp_server_state *s,
+					     const struct sockaddr *sa)
+{
+  struct sntp_addr_stat probe;
+  int i;
+
+  if(sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
+    return NULL;
+  addrSet(&probe, (const struct sockaddr_storage *)sa);
+  for(i = 0; i < SNTP_STATE_ADDRS; i++)
+    if(s->addrs[i].family == probe.family && s->addrs[i].port == probe.port &&
+       memcmp(s->addrs[i].ip, probe.ip, sizeof(probe.ip)) == 0)
+      return &s->addrs[i];
+  return NULL;
+}
+
+/********************************************************************************
+ *SNTPSTATEOPEN - Opens (creating if needed) and maps the state file
+ *A file from another version or of the wrong size is started afresh.
+ *Returns 0, or -1 with st->map NULL if the state can't be used
+ ********************************************************************************/
+int sntpStateOpen(struct sntp_state *st, const char *path)
+{
+  struct stat sb;
+  void *map;
+
+  st->map = NULL;
+  if((st->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+    return -1;
+  lockState(st, F_WRLCK);
+  if(fstat(st->fd, &sb) == -1)
+    goto fail;
+  if(sb.st_size != sizeof(struct sntp_state_file) &&
+     (ftruncate(st->fd, 0) == -1 ||
+      ftruncate(st->fd, sizeof(struct sntp_state_file)) == -1))
+    goto fail;
+  map = mmap(NULL, sizeof(struct sntp_state_file), PROT_READ | PROT_WRITE,
+	     MAP_SHARED, st->fd, 0);
+  if(map == MAP_FAILED)
+    goto fail;
+  st->map = map;
+  if(st->map->magic != SNTP_STATE_MAGIC || st->map->version != SNTP_STATE_VERSION ||
+     st->map->size != sizeof(struct sntp_state_file))
+    {
+      memset(st->map, 0, sizeof(*st->map));
+      st->map->magic = SNTP_STATE_MAGIC;
+      st->map->version = SNTP_STATE_VERSION;
+      st->map->size = sizeof(struct sntp_state_file);
+      st->map->servers = SNTP_STATE_SERVERS;
+    }
+  lockState(st, F_UNLCK);
+  return 0;
+
+ fail:
+  lockState(st, F_UNLCK);
+  close(st->fd);
+  st->fd = -1;
+  return -1;
+}
+
+/********************************************************************************
+ *SNTPSTATECLOSE - Unmaps the state file
+ ********************************************************************************/
+void sntpStateClose(struct sntp_state *st)
+{
+  if(st->map != NULL)
+    munmap(st->map, sizeof(struct sntp_state_file));
+  if(st->fd != -1)
+    close(st->fd);
+  st->map = NULL;
+  st->fd = -1;
+}
+
+/********************************************************************************
+ *SNTPSTATELOOKUP - Copies out what is known about host on port
+ *Returns 0 if found, -1 if the server has never been queried or its
+ *host and port are too long to be remembered (see serverKey)
+ ********************************************************************************/
+int sntpStateLookup(struct sntp_state *st, const char *host, const char *port,
+		    struct sntp_server_state *out)
+{
+  const struct sntp_server_state *s;
+  char key[SNTP_STATE_HOSTLEN];
+  int idx;
+
+  if(st->map == NULL || serverKey(key, host, port) != 0 ||
+     (idx = findServer(st, key, 0)) == -1)
+    return -1;
+  if((s = currentCopy(st->map->slot[idx])) == NULL)
+    return -1;
+  *out = *s;
+  return 0;
+}
+
+/********************************************************************************
+ *SNTPSTATEQUERYSTART - sntpQueryStart() that uses what the state knows
+ *If the server has a best address that hasn't failed since, the query goes
+ *straight to it without resolving. Otherwise the host is resolved, addresses
+ *that failed SNTP_STATE_MAXFAILS times in a row are skipped, and the rest
+ *are tried fastest first (known delays before unknown ones).
+ *Returns as sntpQueryStart()
+ ********************************************************************************/
+int sntpStateQueryStart(struct sntp_state *st, struct sntp_query *q,
+			const char *host, const char *port, int timeout_ms)
+{
+  struct sntp_server_state s;
+  struct sockaddr_storage ss;
+  struct addrinfo ref, *p_result, *p_ts;
+  struct addrinfo *cand[MAX_CANDIDATES];
+  float delay[MAX_CANDIDATES];
+  const struct sntp_addr_stat *a;
+  int known, n = 0, nbad = 0, i, k, status = SNTP_ESOCKET;
+  socklen_t len;
+
+  known = sntpStateLookup(st, host, port, &s) == 0;
+  if(known && s.best >= 0 && s.addrs[s.best].fails == 0)
+    {
+      len = addrGet(&s.addrs[s.best], &ss);
+      status = sntpQueryStartAddr(q, (struct sockaddr *)&ss, len, timeout_ms);
+      if(status != SNTP_ESOCKET)
+	return status;
+    }
+
+  memset(&ref, 0, sizeof(ref));
+  ref.ai_family = AF_UNSPEC; //Allows for IPv4/IPv6
+  ref.ai_socktype = SOCK_DGRAM;
+  if(getaddrinfo(host, port, &ref, &p_result) != 0)
+    {
+      memset(q, 0, sizeof(*q));
+      q->fd = -1;
+      q->status = SNTP_ERESOLVE;
+      return SNTP_ERESOLVE;
+    }
+
+  /*Good addresses fill the front of cand sorted by delay, known bad ones
+   *fill the back and are only tried if nothing else works*/
+  for(p_ts = p_result; p_ts != NULL && n + nbad < MAX_CANDIDATES; p_ts = p_ts->ai_next)
+    {
+      a = known ? addrFind(&s, p_ts->ai_addr) : NULL;
+      if(a != NULL && a->fails >= SNTP_STATE_MAXFAILS)
+	{
+	  cand[MAX_CANDIDATES - 1 - nbad++] = p_ts;
+	  continue;
+	}
+      float d = (a != NULL && a->min_delay > 0) ? a->min_delay : 1e9f;
+      for(k = n; k > 0 && delay[k - 1] > d; k--)
+	{
+	  cand[k] = cand[k - 1];
+	  delay[k] = delay[k - 1];
+	}
+      cand[k] = p_ts;
+      delay[k] = d;
+      n++;
+    }
+  for(i = 0; i < n + nbad && status == SNTP_ESOCKET; i++)
+    {
+      p_ts = i < n ? cand[i] : cand[MAX_CANDIDATES - 1 - (i - n)];
+      status = sntpQueryStartAddr(q, p_ts->ai_addr, p_ts->ai_addrlen, timeout_ms);
+    }
+  freeaddrinfo(p_result);
+  return status;
+}
+
+/********************************************************************************
+ *SNTPSTATERECORD - Stores the outcome of a finished query
+ *Success updates the address and server delays, the last offset and the
+ *drift estimate. Any failure counts against the address queried.
+ *Returns 0, or -1 if there is no state or the server can't be remembered
+ ********************************************************************************/
+int sntpStateRecord(struct sntp_state *st, const char *host, const char *port,
+		    const struct sntp_query *q)
+{
+  struct sntp_server_state s, *dest;
+  const struct sntp_server_state *cur;
+  struct sntp_addr_stat *a;
+  char key[SNTP_STATE_HOSTLEN];
+  int idx, i, worst = 0;
+  double dt, drift;
+  long page;
+  uintptr_t start;
+
+  if(st->map == NULL || q->addrlen == 0 || serverKey(key, host, port) != 0)
+    return -1;
+  lockState(st, F_WRLCK);
+  idx = findServer(st, key, 1);
+  cur = currentCopy(st->map->slot[idx]);
+  if(cur != NULL && strncmp(cur->host, key, SNTP_STATE_HOSTLEN) == 0)
+    s = *cur;
+  else
+    {
+      memset(&s, 0, sizeof(s));
+      memcpy(s.host, key, sizeof(s.host));
+      s.best = -1;
+    }
+
+  //find the address, or take an empty entry, or the one failing most
+  a = (struct sntp_addr_stat *)addrFind(&s, (const struct sockaddr *)&q->addr);
+  if(a == NULL)
+    {
+      for(i = 0; i < SNTP_STATE_ADDRS; i++)
+	{
+	  if(s.addrs[i].family == 0)
+	    {
+	      worst = i;
+	      break;
+	    }
+	  if(s.addrs[i].fails > s.addrs[worst].fails)
+	    worst = i;
+	}
+      a = &s.addrs[worst];
+      addrSet(a, &q->addr);
+    }
+
+  if(q->status == SNTP_OK)
+    {
+      a->fails = 0;
+      if(a->oks < 0xFFFF)
+	a->oks++;
+      if(a->min_delay <= 0 || q->result.delay < a->min_delay)
+	a->min_delay = q->result.delay > 0 ? q->result.delay : 1e-9;
+      if(s.min_delay <= 0 || q->result.delay < s.min_delay)
+	s.min_delay = a->min_delay;
+      if(s.last_update != 0)
+	{
+	  dt = ntpDiff(q->result.t4, s.last_update);
+	  if(dt >= FREQ_MIN_INTERVAL)
+	    {
+	      drift = (q->result.offset - s.last_offset) / dt;
+	      s.freq_error = s.freq_error == 0 ? drift :
+		(1 - FREQ_WEIGHT) * s.freq_error + FREQ_WEIGHT * drift;
+	    }
+	}
+      //the reference offset only moves on once drift can be measured
+      //against it, so runs close together still build up an estimate
+      if(s.last_update == 0 || ntpDiff(q->result.t4, s.last_update) >= FREQ_MIN_INTERVAL)
+	{
+	  s.last_offset = q->result.offset;
+	  s.last_update = q->result.t4;
+	}
+    }
+  else if(a->fails < 0xFFFF)
+    a->fails++;
+
+  s.best = -1;
+  for(i = 0; i < SNTP_STATE_ADDRS; i++)
+    if(s.addrs[i].family != 0 && s.addrs[i].fails == 0 && s.addrs[i].min_delay > 0 &&
+       (s.best == -1 || s.addrs[i].min_delay < s.addrs[s.best].min_delay))
+      s.best = i;
+
+  //write over the older copy, the current one stays valid until we're done
+  dest = &st->map->slot[idx][0];
+  if(cur == dest)
+    dest = &st->map->slot[idx][1];
+  s.gen = (cur != NULL ? cur->gen : 0) + 1;
+  if(cur == NULL)
+    for(i = 0; i < 2; i++)
+      if(st->map->slot[idx][i].gen >= s.gen)
+	s.gen = st->map->slot[idx][i].gen + 1;
+  s.checksum = recordChecksum(&s);
+  memcpy(dest, &s, sizeof(s));
+
+  page = sysconf(_SC_PAGESIZE);
+  start = (uintptr_t)dest & ~(uintptr_t)(page - 1);
+  msync((void *)start, (uintptr_t)dest + sizeof(s) - start, MS_SYNC);
+  lockState(st, F_UNLCK);
+  return 0;
+}
+
+/********************************************************************************
+ *SNTPSTATEPREDICT - Offset expected now from the last one and the drift
+ ********************************************************************************/
+double sntpStatePredict(const struct sntp_server_state *s, u_int64_t now)
+{
+  if(s->last_update == 0)
+    return 0;
+  return s->last_offset + s->freq_error * ntpDiff(now, s->last_update);
+}
+
+/********************************************************************************
+ *SNTPSTATETRUSTED - Whether a result can be used straight away
+ *A reply whose round trip is close to the best this server has ever
+ *managed wasn't queued anywhere on the way, so its offset is as good as
+ *a filtered one. Returns 1 if trusted, 0 if not or nothing is known yet
+ ********************************************************************************/
+int sntpStateTrusted(const struct sntp_server_state *s,
+		     const struct sntp_result *r)
+{
+  if(s->min_delay <= 0)
+    return 0;
+  return r->delay <= 2 * s->min_delay + TRUST_SLACK;
+}
@@ -0,0 +1,86 @@
+#ifndef SNTP_STATE_H
+#define SNTP_STATE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "sntp_client.h"
+
+/********************************************************************************
+ *sntp_state.h - Persisted client state for warm starts
+ *
+ *A small fixed size file, mapped with mmap(), remembering for each server
+ *the smallest delay seen, the last offset and when it was taken, an
+ *estimate of the local clock's frequency error and how every address the
+ *server resolved to has behaved. Opening it is an open()+mmap(), so a run
+ *can go straight to the best known address without waiting on DNS.
+ *
+ *Crash safety: every server has two copies of its record, each with a
+ *generation number and checksum. An update always overwrites the older
+ *copy, so a crash part way through leaves the newer one intact and the
+ *torn copy fails its checksum. Updates take an fcntl() lock so clients
+ *running at the same time don't interleave.
+ ********************************************************************************/
+
+#define SNTP_STATE_MAGIC 0x53544e53 //"SNTS"
+#define SNTP_STATE_VERSION 2
+#define SNTP_STATE_SERVERS 64  //servers remembered
+#define SNTP_STATE_ADDRS 8     //addresses remembered per server
+#define SNTP_STATE_HOSTLEN 64
+#define SNTP_STATE_MAXFAILS 3  //failures in a row before an address is skipped
+
+/*One address a server resolved to, stored compactly*/
+struct sntp_addr_stat
+{
+  u_int8_t family;     //AF_INET/AF_INET6, 0 if unused
+  u_int8_t pad;
+  u_int16_t port;      //network order
+  u_int8_t ip[16];
+  float min_delay;     //seconds, 0 if never answered
+  u_int16_t fails;     //failures since the last success
+  u_int16_t oks;       //successes (saturating)
+};
+
+/*One copy of a server's record*/
+struct sntp_server_state
+{
+  u_int64_t gen;                 //generation, 0 means empty
+  char host[SNTP_STATE_HOSTLEN]; //"host/port": each port is its own server
+  double min_delay;              //seconds, smallest round trip seen
+  double last_offset;            //seconds
+  u_int64_t last_update;         //NTP time last_offset was measured
+  double freq_error;             //change in offset, seconds per second
+  int32_t best;                  //index into addrs, -1 if none
+  u_int32_t pad;
+  struct sntp_addr_stat addrs[SNTP_STATE_ADDRS];
+  u_int32_t checksum;            //over everything above
+};
+
+struct sntp_state_file
+{
+  u_int32_t magic;
+  u_int32_t version;
+  u_int32_t size;
+  u_int32_t servers;
+  struct sntp_server_state slot[SNTP_STATE_SERVERS][2];
+};
+
+struct sntp_state
+{
+  int fd;
+  struct sntp_state_file *map;
+};
+
+/*FUNCTION PROTO DECLARATION */
+int sntpStateOpen(struct sntp_state *st, const char *path);
+void sntpStateClose(struct sntp_state *st);
+int sntpStateLookup(struct sntp_state *st, const char *host, const char *port,
+		    struct sntp_server_state *out);
+int sntpStateQueryStart(struct sntp_state *st, struct sntp_query *q,
+			const char *host, const char *port, int timeout_ms);
+int sntpStateRecord(struct sntp_state *st, const char *host, const char *port,
+		    const struct sntp_query *q);
+int sntpStateTrusted(const struct sntp_server_state *s,
+		     const struct sntp_result *r);
+double sntpStatePredict(const struct sntp_server_state *s, u_int64_t now);
+
+#endif
@@ -54,14 +54,17 @@ struct sntp_packet
 
 /*FUNCTION PROTO DECLARATION */
 
+/*Library functions are declared in sntp_client.h*/
+struct sntp_query;
+struct sntp_state;
+
 u_int64_t tv_to_ntp(struct timeval tv);
 struct timeval ntp_to_tv(unsigned long long ntp);
-void zeroPacket(union sntp_union *un);
-void buildReqPacket(union sntp_union *un);
 void print_tv(struct timeval tv);
 void printRP(union sntp_union *un);
-void packetDecode(union sntp_union *un);
-int sockethandler(union sntp_union *un, char *argv[]);
+int sockethandler(struct sntp_query *q, const char *host, const char *port,
+		  struct sntp_state *st);
 void printFormatTS(union sntp_union *un);
+int listenBroadcast(const char *group, double delay);
 
 #endif 
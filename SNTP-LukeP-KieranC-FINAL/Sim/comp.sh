@@ -0,0 +1,9 @@
+#!/usr/bin/bash
+#sim links the server's packet code and the client library directly
+if gcc -Wall -O2 sim.c sim_server.c sim_client.c ../Kieran/packet.c \
+       ../Kieran/timesource.c ../Kieran/upstream.c ../Luke/sntp_client.c \
+       -o sim -lpthread -lm; then
+    echo "Holy Shit it worked"
+else
+    echo "Ahhh, close but no cigar"
+fi
@@ -0,0 +1,676 @@
+/********************************************************************************
+Program Name: SNTP Simulator
+Description:
+Runs any number of SNTP clients against the server inside one process,
+over a simulated network and with simulated clocks. Requests are built and
+replies decoded by the client library, replies are built by the server's
+packet code; only the sockets and clocks are replaced. Time is virtual, so
+an hour of traffic takes as long as the packets take to process, and a
+run depends only on its script: the same script and seed give the same
+output every time.
+
+For every answered exchange the measured offset is compared with the true
+offset between the two clocks, and the distribution of the error is
+reported along with what was lost where.
+
+Usage: ./sim script [-o samples.csv]
+   -o  also write every exchange (time, client, error, delay) to a file
+
+Script format, one setting per line, # starts a comment, times and delays
+in seconds:
+   duration 3600        simulated time to run for
+   clients 100          number of clients
+   poll 64              seconds between each client's requests
+   burst 0              1: every client polls at the same instants,
+                        0: spread evenly over the poll interval
+   seed 1               random number seed
+   server_offset 0      server clock error at time 0, "at" steps the
+                        clock by the change
+   server_skew 0        server clock frequency error, ppm, "at" changes
+                        the rate from then on without a step
+   server_noise 0       standard deviation of each server clock read
+   server_service 1e-4  time to answer one request (the fork)
+   server_service_jitter 0   mean of an extra exponential service time
+   server_queue 1000    requests waiting before more are dropped
+   client_offset 0      client clock error at time 0 ...
+   client_offset_spread 0    ... plus uniform +- this much per client
+   client_skew 0        client frequency error, ppm ...
+   client_skew_spread 0 ... plus uniform +- this much per client
+   client_noise 0       standard deviation of each client clock read
+   up_delay 0.01        client to server: fixed delay ...
+   up_jitter 0          ... plus an exponential delay with this mean
+   up_loss 0            ... and this probability of loss
+   down_delay, down_jitter, down_loss   the same, server to client
+   at 1800 down_delay 0.1    change a setting part way through
+
+The server answers requests one at a time in arrival order. Its receive
+timestamp is taken when it starts on a request, as in the forked child,
+so time spent queued behind a burst shows up as offset error.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "sim.h"
+
+/********************************************************************************
+DEFINITIONS
+********************************************************************************/
+
+#define SIMEPOCH 3900000000ULL //NTP seconds at simulated time 0 (2023)
+#define NSEC 1000000000ULL
+#define SCRIPTLINE 512
+#define MAXCHANGES 256
+
+#define EV_POLL 0          //a client sends a request
+#define EV_SERVER_ARRIVE 1 //a request reaches the server
+#define EV_SERVER_DONE 2   //the server sends its reply
+#define EV_CLIENT_ARRIVE 3 //a reply reaches a client
+#define EV_CHANGE 4        //an "at" line takes effect
+
+struct sim_settings{
+  double duration, clients, poll, burst, seed;
+  double server_offset, server_skew, server_noise;
+  double server_service, server_service_jitter, server_queue;
+  double client_offset, client_offset_spread;
+  double client_skew, client_skew_spread, client_noise;
+  double up_delay, up_jitter, up_loss;
+  double down_delay, down_jitter, down_loss;
+};
+
+struct setting_name{
+  const char *name;
+  size_t offset;
+  int start_only; //can't be changed with "at"
+};
+
+#define SETTING(field, start) { #field, offsetof(struct sim_settings, field), start }
+static const struct setting_name setting_names[] = {
+  SETTING(duration, 1), SETTING(clients, 1), SETTING(poll, 1),
+  SETTING(burst, 1), SETTING(seed, 1),
+  SETTING(server_offset, 0), SETTING(server_skew, 0),
+  SETTING(server_noise, 0), SETTING(server_service, 0),
+  SETTING(server_service_jitter, 0), SETTING(server_queue, 1),
+  SETTING(client_offset, 1), SETTING(client_offset_spread, 1),
+  SETTING(client_skew, 1), SETTING(client_skew_spread, 1),
+  SETTING(client_noise, 0),
+  SETTING(up_delay, 0), SETTING(up_jitter, 0), SETTING(up_loss, 0),
+  SETTING(down_delay, 0), SETTING(down_jitter, 0), SETTING(down_loss, 0),
+};
+#define NSETTINGS (sizeof(setting_names) / sizeof(setting_names[0]))
+
+struct change{
+  uint64_t time;
+  int setting;
+  double value;
+};
+
+struct event{
+  uint64_t time;
+  uint64_t seq; //breaks ties in scheduling order
+  int type;
+  int client;
+  unsigned char pkt[SIMPACKET];
+};
+
+struct event_heap{
+  struct event *ev;
+  size_t n, cap;
+  uint64_t seq;
+};
+
+struct sim_client{
+  struct sim_clock clock;
+  unsigned char req[SIMPACKET]; //outstanding request
+  uint64_t t1;
+  uint64_t sent;                //true time it was sent
+};
+
+struct queued{
+  int client;
+  unsigned char pkt[SIMPACKET];
+};
+
+struct sim_stats{
+  uint64_t sent, answered, lost_up, lost_down, dropped, stale, rejected;
+  size_t max_queue;
+  double *error, *delay; //per answered exchange
+  size_t n, cap;
+};
+
+uint64_t sim_time_ns = 0;
+static uint64_t rng_state;
+static struct sim_settings set;
+
+/********************************************************************************
+RANDOM
+Arguments: N/A
+Returns: uniform in [0, 1), from a seeded xorshift64* generator
+********************************************************************************/
+static double random_uniform(void){
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double random_exponential(double mean){
+  return mean > 0 ? -mean * log(1.0 - random_uniform()) : 0;
+}
+
+static double random_gaussian(void){
+  return sqrt(-2.0 * log(1.0 - random_uniform())) *
+    cos(2 * M_PI * random_uniform());
+}
+
+/********************************************************************************
+CLOCK_ERROR
+Arguments: const struct sim_clock *c: clock
+           uint64_t t: true time, ns
+Returns: how far ahead of true time the clock is at t, without read noise
+********************************************************************************/
+static double clock_error(const struct sim_clock *c, uint64_t t){
+  return c->offset + c->skew * 1e-6 * ((int64_t)(t - c->since) * 1e-9);
+}
+
+/********************************************************************************
+SIM_CLOCK_NTP
+Reads a simulated clock at the current true time. Used as the server's
+time source hook and the client library's clock.
+
+Arguments: void *clock: struct sim_clock
+Returns: NTP timestamp (host order)
+********************************************************************************/
+uint64_t sim_clock_ntp(void *clock){
+  struct sim_clock *c = clock;
+  double err = clock_error(c, sim_time_ns);
+
+  if (c->noise > 0){
+    err += c->noise * random_gaussian();
+  }
+  return ((SIMEPOCH + sim_time_ns / NSEC) << 32) +
+    (((sim_time_ns % NSEC) << 32) / NSEC) +
+    (uint64_t)(int64_t)llround(err * 4294967296.0);
+}
+
+/********************************************************************************
+HEAP_PUSH / HEAP_POP
+Binary heap of pending events, earliest (then first scheduled) on top
+********************************************************************************/
+static int event_before(const struct event *a, const struct event *b){
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void heap_push(struct event_heap *h, struct event *e){
+  size_t i, parent;
+
+  if (h->n == h->cap){
+    h->cap = h->cap ? h->cap * 2 : 1024;
+    if ((h->ev = realloc(h->ev, h->cap * sizeof(*h->ev))) == NULL){
+      perror("sim: realloc");
+      exit(1);
+    }
+  }
+  e->seq = h->seq++;
+  for (i = h->n++; i > 0; i = parent){
+    parent = (i - 1) / 2;
+    if (!event_before(e, &h->ev[parent])){
+      break;
+    }
+    h->ev[i] = h->ev[parent];
+  }
+  h->ev[i] = *e;
+}
+
+static void heap_pop(struct event_heap *h, struct event *out){
+  struct event last;
+  size_t i = 0, child;
+
+  *out = h->ev[0];
+  last = h->ev[--h->n];
+  while ((child = 2 * i + 1) < h->n){
+    if (child + 1 < h->n && event_before(&h->ev[child + 1], &h->ev[child])){
+      child++;
+    }
+    if (!event_before(&h->ev[child], &last)){
+      break;
+    }
+    h->ev[i] = h->ev[child];
+    i = child;
+  }
+  h->ev[i] = last;
+}
+
+/********************************************************************************
+SCHEDULE
+Queues an event delay seconds from now
+
+Arguments: struct event_heap *h: pending events
+           double delay: seconds from now
+           int type: EV_*
+           int client: client the event is for
+           const unsigned char *pkt: packet carried, NULL for none
+Returns: N/A
+********************************************************************************/
+static void schedule(struct event_heap *h, double delay, int type, int client,
+		     const unsigned char *pkt){
+  struct event e;
+
+  e.time = sim_time_ns + (uint64_t)llround(delay * 1e9);
+  e.type = type;
+  e.client = client;
+  if (pkt != NULL){
+    memcpy(e.pkt, pkt, SIMPACKET);
+  }
+  heap_push(h, &e);
+}
+
+/********************************************************************************
+FIND_SETTING
+Arguments: const char *name: setting name
+Returns: index into setting_names, -1 if unknown
+********************************************************************************/
+static int find_setting(const char *name){
+  size_t i;
+
+  for (i = 0; i < NSETTINGS; i++){
+    if (strcmp(setting_names[i].name, name) == 0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+static double *setting_value(int i){
+  return (double *)((char *)&set + setting_names[i].offset);
+}
+
+/********************************************************************************
+SCRIPT_LOAD
+Reads a script into set and the list of timed changes
+
+Arguments: const char *path: script file
+           struct change *changes: MAXCHANGES entries
+           int *nchanges: number stored
+Returns: error handle
+********************************************************************************/
+static int script_load(const char *path, struct change *changes, int *nchanges){
+  FILE *fp;
+  char line[SCRIPTLINE], key[SCRIPTLINE], value[SCRIPTLINE];
+  char extra[2][SCRIPTLINE];
+  double when;
+  int lineno = 0, fields, i, err = 0;
+
+  if ((fp = fopen(path, "r")) == NULL){
+    perror(path);
+    return 1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL){
+    lineno++;
+    line[strcspn(line, "#\r\n")] = '\0';
+    fields = sscanf(line, "%511s %511s %511s %511s",
+		    key, value, extra[0], extra[1]);
+    if (fields <= 0){
+      continue;
+    }
+    if (strcmp(key, "at") == 0){
+      if (sscanf(line, "%*s %lf %511s %511s", &when, key, value) != 3){
+	fprintf(stderr, "%s:%d: expected: at time setting value\n", path, lineno);
+	err = 1;
+	continue;
+      }
+      if ((i = find_setting(key)) == -1 || setting_names[i].start_only){
+	fprintf(stderr, "%s:%d: %s can't be changed with at\n",
+		path, lineno, key);
+	err = 1;
+	continue;
+      }
+      if (*nchanges == MAXCHANGES){
+	fprintf(stderr, "%s:%d: more than %d changes\n",
+		path, lineno, MAXCHANGES);
+	err = 1;
+	continue;
+      }
+      changes[*nchanges].time = (uint64_t)llround(when * 1e9);
+      changes[*nchanges].setting = i;
+      changes[*nchanges].value = atof(value);
+      (*nchanges)++;
+    } else if (fields != 2){
+      fprintf(stderr, "%s:%d: expected: setting value\n", path, lineno);
+      err = 1;
+    } else if ((i = find_setting(key)) == -1){
+      fprintf(stderr, "%s:%d: unknown setting %s\n", path, lineno, key);
+      err = 1;
+    } else{
+      *setting_value(i) = atof(value);
+    }
+  }
+  fclose(fp);
+  if (!err && (set.clients < 1 || set.poll <= 0 || set.duration <= 0)){
+    fprintf(stderr, "%s: clients, poll and duration must be positive\n", path);
+    err = 1;
+  }
+  return err;
+}
+
+/********************************************************************************
+SCRIPT_DEFAULTS
+Arguments: N/A
+Returns: N/A
+********************************************************************************/
+static void script_defaults(void){
+  memset(&set, 0, sizeof(set));
+  set.duration = 3600;
+  set.clients = 100;
+  set.poll = 64;
+  set.seed = 1;
+  set.server_service = 1e-4;
+  set.server_queue = 1000;
+  set.up_delay = 0.01;
+  set.down_delay = 0.01;
+}
+
+/********************************************************************************
+STATS_ADD
+Arguments: struct sim_stats *st: statistics
+           double error, delay: one answered exchange
+Returns: N/A
+********************************************************************************/
+static void stats_add(struct sim_stats *st, double error, double delay){
+  if (st->n == st->cap){
+    st->cap = st->cap ? st->cap * 2 : 65536;
+    st->error = realloc(st->error, st->cap * sizeof(double));
+    st->delay = realloc(st->delay, st->cap * sizeof(double));
+    if (st->error == NULL || st->delay == NULL){
+      perror("sim: realloc");
+      exit(1);
+    }
+  }
+  st->error[st->n] = error;
+  st->delay[st->n++] = delay;
+}
+
+static int compare_doubles(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/********************************************************************************
+PERCENTILE
+Arguments: const double *sorted: values in order
+           size_t n: number of values
+           double p: 0-100
+Returns: the value p percent of the way through
+********************************************************************************/
+static double percentile(const double *sorted, size_t n, double p){
+  size_t i = (size_t)(p / 100 * (n - 1) + 0.5);
+  return sorted[i < n ? i : n - 1];
+}
+
+/********************************************************************************
+STATS_REPORT
+Prints what happened to the exchanges and the offset error distribution
+
+Arguments: struct sim_stats *st: statistics, the samples are sorted
+Returns: N/A
+********************************************************************************/
+static void stats_report(struct sim_stats *st){
+  double sum = 0, sumsq = 0, mean, worst = 0;
+  size_t i;
+
+  printf("exchanges: %llu sent, %llu answered (%.2f%%)\n",
+	 (unsigned long long)st->sent, (unsigned long long)st->answered,
+	 st->sent ? 100.0 * st->answered / st->sent : 0);
+  printf("  lost: %llu on the way up, %llu on the way down, %llu dropped by"
+	 " the server (queue peaked at %zu)\n",
+	 (unsigned long long)st->lost_up, (unsigned long long)st->lost_down,
+	 (unsigned long long)st->dropped, st->max_queue);
+  printf("  ignored by clients: %llu stale, %llu rejected\n",
+	 (unsigned long long)st->stale, (unsigned long long)st->rejected);
+  if (st->n == 0){
+    return;
+  }
+  for (i = 0; i < st->n; i++){
+    sum += st->error[i];
+    sumsq += st->error[i] * st->error[i];
+    if (fabs(st->error[i]) > worst){
+      worst = fabs(st->error[i]);
+    }
+  }
+  mean = sum / st->n;
+  qsort(st->error, st->n, sizeof(double), compare_doubles);
+  qsort(st->delay, st->n, sizeof(double), compare_doubles);
+  printf("offset error (s): mean %+.9f, sd %.9f, max |error| %.9f\n",
+	 mean, sqrt(fabs(sumsq / st->n - mean * mean)), worst);
+  printf("  percentiles: 1%% %+.9f, 5%% %+.9f, 50%% %+.9f, 95%% %+.9f,"
+	 " 99%% %+.9f\n",
+	 percentile(st->error, st->n, 1), percentile(st->error, st->n, 5),
+	 percentile(st->error, st->n, 50), percentile(st->error, st->n, 95),
+	 percentile(st->error, st->n, 99));
+  printf("delay (s): 50%% %.9f, 99%% %.9f, max %.9f\n",
+	 percentile(st->delay, st->n, 50), percentile(st->delay, st->n, 99),
+	 st->delay[st->n - 1]);
+}
+
+/********************************************************************************
+MAIN
+Loads the script, sets up the clocks, then runs events in time order until
+the duration is up.
+********************************************************************************/
+int main(int argc, char *argv[]){
+  struct change changes[MAXCHANGES];
+  struct event_heap heap;
+  struct event ev;
+  struct sim_client *clients, *c;
+  struct sim_clock server_clock;
+  struct sim_stats st;
+  struct queued *queue, job;
+  size_t qhead = 0, qlen = 0, qcap;
+  unsigned char reply[SIMPACKET];
+  struct timespec wall_start, wall_end;
+  uint64_t end;
+  double offset, delay, truth, wall, step;
+  char *samples_path = NULL;
+  FILE *samples = NULL;
+  int nchanges = 0, nclients, opt, i, busy = 0, rv;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1){
+    switch(opt){
+    case 'o':
+      samples_path = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  }
+  if (argc - optind != 1){
+    fprintf(stderr, "Usage: %s script [-o samples.csv]\n", argv[0]);
+    return 1;
+  }
+  script_defaults();
+  if (script_load(argv[optind], changes, &nchanges) != 0){
+    return 1;
+  }
+  if (samples_path != NULL){
+    if ((samples = fopen(samples_path, "w")) == NULL){
+      perror(samples_path);
+      return 1;
+    }
+    fprintf(samples, "time,client,error,delay\n");
+  }
+
+  rng_state = (uint64_t)set.seed * 0x9E3779B97F4A7C15ULL + 1;
+  nclients = (int)set.clients;
+  qcap = set.server_queue > 1 ? (size_t)set.server_queue : 1;
+  clients = calloc(nclients, sizeof(*clients));
+  queue = malloc(qcap * sizeof(*queue));
+  if (clients == NULL || queue == NULL){
+    perror("sim: malloc");
+    return 1;
+  }
+  memset(&heap, 0, sizeof(heap));
+  memset(&st, 0, sizeof(st));
+  server_clock.offset = set.server_offset;
+  server_clock.since = 0;
+  server_clock.skew = set.server_skew;
+  server_clock.noise = set.server_noise;
+  sim_server_init(&server_clock);
+  if (sim_client_init() != 0){
+    return 1;
+  }
+
+  for (i = 0; i < nclients; i++){
+    c = &clients[i];
+    c->clock.offset = set.client_offset +
+      set.client_offset_spread * (2 * random_uniform() - 1);
+    c->clock.skew = set.client_skew +
+      set.client_skew_spread * (2 * random_uniform() - 1);
+    c->clock.noise = set.client_noise;
+    schedule(&heap, set.burst ? 0 : set.poll * i / nclients, EV_POLL, i, NULL);
+  }
+  memset(&ev, 0, sizeof(ev));
+  for (i = 0; i < nchanges; i++){
+    ev.time = changes[i].time;
+    ev.type = EV_CHANGE;
+    ev.client = i;
+    heap_push(&heap, &ev);
+  }
+
+  end = (uint64_t)llround(set.duration * 1e9);
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+  while (heap.n > 0){
+    heap_pop(&heap, &ev);
+    if (ev.time > end){
+      break;
+    }
+    sim_time_ns = ev.time;
+
+    switch(ev.type){
+    case EV_POLL:
+      c = &clients[ev.client];
+      sim_client_clock(&c->clock);
+      c->t1 = sim_client_request(c->req);
+      c->sent = sim_time_ns;
+      st.sent++;
+      if (random_uniform() < set.up_loss){
+	st.lost_up++;
+      } else{
+	schedule(&heap, set.up_delay + random_exponential(set.up_jitter),
+		 EV_SERVER_ARRIVE, ev.client, c->req);
+      }
+      schedule(&heap, set.poll, EV_POLL, ev.client, NULL);
+      break;
+
+    case EV_SERVER_ARRIVE:
+      if (qlen == qcap){
+	st.dropped++; //socket receive queue full
+	break;
+      }
+      queue[(qhead + qlen) % qcap].client = ev.client;
+      memcpy(queue[(qhead + qlen++) % qcap].pkt, ev.pkt, SIMPACKET);
+      if (qlen > st.max_queue){
+	st.max_queue = qlen;
+      }
+      if (!busy){
+	busy = 1;
+	schedule(&heap, 0, EV_SERVER_DONE, -1, NULL); //start on it now
+      }
+      break;
+
+    case EV_SERVER_DONE:
+      if (ev.client >= 0){
+	//finish the current request
+	memcpy(reply, ev.pkt, SIMPACKET);
+	sim_server_transmit(reply);
+	if (random_uniform() < set.down_loss){
+	  st.lost_down++;
+	} else{
+	  schedule(&heap, set.down_delay + random_exponential(set.down_jitter),
+		   EV_CLIENT_ARRIVE, ev.client, reply);
+	}
+      }
+      if (qlen == 0){
+	busy = 0;
+	break;
+      }
+      //start the next one: receive timestamp now, transmit when done
+      job = queue[qhead];
+      qhead = (qhead + 1) % qcap;
+      qlen--;
+      sim_server_receive(reply, job.pkt);
+      schedule(&heap, set.server_service +
+	       random_exponential(set.server_service_jitter),
+	       EV_SERVER_DONE, job.client, reply);
+      break;
+
+    case EV_CLIENT_ARRIVE:
+      c = &clients[ev.client];
+      sim_client_clock(&c->clock);
+      rv = sim_client_reply(c->req, ev.pkt, c->t1, &offset, &delay);
+      if (rv < 0){
+	return 1;
+      }
+      if (rv == SIMREPLY_STALE){
+	st.stale++;
+	break;
+      }
+      if (rv == SIMREPLY_REJECTED){
+	st.rejected++;
+	break;
+      }
+      st.answered++;
+      //true offset of the server clock from this client's, mid exchange
+      truth = clock_error(&server_clock, (c->sent + sim_time_ns) / 2) -
+	clock_error(&c->clock, (c->sent + sim_time_ns) / 2);
+      stats_add(&st, offset - truth, delay);
+      if (samples != NULL){
+	fprintf(samples, "%.6f,%d,%.9f,%.9f\n", sim_time_ns * 1e-9,
+		ev.client, offset - truth, delay);
+      }
+      break;
+
+    case EV_CHANGE:
+      step = set.server_offset;
+      *setting_value(changes[ev.client].setting) = changes[ev.client].value;
+      step = set.server_offset - step;
+      //rebase on now, so the drift so far is kept and a new skew only
+      //applies from here on
+      server_clock.offset = clock_error(&server_clock, sim_time_ns) + step;
+      server_clock.since = sim_time_ns;
+      server_clock.skew = set.server_skew;
+      server_clock.noise = set.server_noise;
+      for (i = 0; i < nclients; i++){
+	clients[i].clock.noise = set.client_noise;
+      }
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  wall = (wall_end.tv_sec - wall_start.tv_sec) +
+    (wall_end.tv_nsec - wall_start.tv_nsec) * 1e-9;
+
+  printf("simulated %.0f s, %d clients polling every %.0f s\n",
+	 set.duration, nclients, set.poll);
+  stats_report(&st);
+  //wall clock figures vary from run to run, so they go to stderr
+  fprintf(stderr, "sim: %.3f s wall, %.0f exchanges/s, %.0fx real time\n",
+	  wall, wall > 0 ? st.answered / wall : 0,
+	  wall > 0 ? set.duration / wall : 0);
+  if (samples != NULL){
+    fclose(samples);
+  }
+  free(st.error);
+  free(st.delay);
+  free(heap.ev);
+  free(queue);
+  free(clients);
+  return 0;
+}
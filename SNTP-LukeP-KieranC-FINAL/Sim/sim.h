@@ -0,0 +1,44 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+/********************************************************************************
+SIMULATOR INTERFACES
+sim.c runs the network and the clocks. The server and client code cannot
+share a file (structure.h and sntp_structFuncs.h both define struct
+sntp_packet), so each is wrapped in its own file and packets cross between
+them as plain bytes.
+********************************************************************************/
+
+#define SIMPACKET 48
+
+#define SIMREPLY_OK 0
+#define SIMREPLY_STALE 1    //not the reply to the outstanding request
+#define SIMREPLY_REJECTED 2 //refused by sntpQueryProcess(): bad reply or KoD
+
+/*A node's clock: true time plus offset, a frequency error and read noise*/
+struct sim_clock{
+  double offset; //seconds ahead of true time at time since
+  uint64_t since; //true time, ns, offset was taken at
+  double skew;   //frequency error, ppm
+  double noise;  //standard deviation of each read, seconds
+};
+
+/*sim.c*/
+extern uint64_t sim_time_ns; //true time now
+uint64_t sim_clock_ntp(void *clock);
+
+/*sim_server.c - the server's packet building (../Kieran/packet.c)*/
+void sim_server_init(struct sim_clock *clock);
+void sim_server_receive(unsigned char *reply, const unsigned char *req);
+void sim_server_transmit(unsigned char *reply);
+
+/*sim_client.c - the client library (../Luke/sntp_client.c)*/
+int sim_client_init(void);
+void sim_client_clock(struct sim_clock *clock);
+uint64_t sim_client_request(unsigned char *req);
+int sim_client_reply(const unsigned char *req, const unsigned char *reply,
+		     uint64_t t1, double *offset, double *delay);
+
+#endif
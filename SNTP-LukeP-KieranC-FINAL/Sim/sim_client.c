@@ -0,0 +1,105 @@
+/********************************************************************************
+Program Name: SNTP Simulator - client side
+Description:
+Builds requests and processes replies with the client library
+(../Luke/sntp_client.c), whose clock is pointed at a simulated client
+clock with sntpSetClock(). Each reply is written into a local datagram
+socket pair and read back by sntpQueryProcess(), so it is checked and
+decoded by exactly the code a real client runs.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../Luke/sntp_client.h"
+#include "sim.h"
+
+static int reply_fds[2] = { -1, -1 }; //written to [0], read by the library from [1]
+
+/********************************************************************************
+SIM_CLIENT_INIT
+Creates the socket pair replies are delivered through
+
+Arguments: N/A
+Returns: error handle
+********************************************************************************/
+int sim_client_init(void){
+  if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+		 reply_fds) == -1){
+    perror("sim: socketpair");
+    return 1;
+  }
+  return 0;
+}
+
+/********************************************************************************
+SIM_CLIENT_CLOCK
+Arguments: struct sim_clock *clock: clock of the client about to act
+Returns: N/A
+********************************************************************************/
+void sim_client_clock(struct sim_clock *clock){
+  sntpSetClock(sim_clock_ntp, clock);
+}
+
+/********************************************************************************
+SIM_CLIENT_REQUEST
+Arguments: unsigned char *req: SIMPACKET bytes, filled with a request
+Returns: T1, the client clock when the request was built
+********************************************************************************/
+uint64_t sim_client_request(unsigned char *req){
+  union sntp_union un;
+  uint64_t t1;
+
+  zeroPacket(&un);
+  t1 = buildReqPacket(&un);
+  memcpy(req, un.bytes, SIMPACKET);
+  return t1;
+}
+
+/********************************************************************************
+SIM_CLIENT_REPLY
+Hands a reply to sntpQueryProcess() as if it had arrived on the query's
+socket, with T4 read from the client clock now. The query gets its own
+copy of the read end, which the library closes when the query finishes.
+
+Arguments: const unsigned char *req: the outstanding request
+           const unsigned char *reply: what arrived
+           uint64_t t1: from sim_client_request
+           double *offset, *delay: results, seconds
+Returns: SIMREPLY_OK, SIMREPLY_STALE or SIMREPLY_REJECTED, -1 on error
+********************************************************************************/
+int sim_client_reply(const unsigned char *req, const unsigned char *reply,
+		     uint64_t t1, double *offset, double *delay){
+  struct sntp_query q;
+  int status;
+
+  memset(&q, 0, sizeof(q));
+  memcpy(q.req.bytes, req, SIMPACKET);
+  q.t1 = t1;
+  q.deadline = UINT64_MAX; //timeouts are sim.c's business
+  q.status = SNTP_EAGAIN;
+  if ((q.fd = dup(reply_fds[1])) == -1){
+    perror("sim: dup");
+    return -1;
+  }
+  if (send(reply_fds[0], reply, SIMPACKET, 0) != SIMPACKET){
+    perror("sim: send");
+    close(q.fd);
+    return -1;
+  }
+  status = sntpQueryProcess(&q);
+  if (status == SNTP_EAGAIN){
+    sntpQueryClose(&q);
+    return SIMREPLY_STALE;
+  }
+  if (status != SNTP_OK){
+    return SIMREPLY_REJECTED;
+  }
+  *offset = q.result.offset;
+  *delay = q.result.delay;
+  return SIMREPLY_OK;
+}
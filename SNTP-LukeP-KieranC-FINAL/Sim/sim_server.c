@@ -0,0 +1,61 @@
+/********************************************************************************
+Program Name: SNTP Simulator - server side
+Description:
+Builds replies with the server's own code (../Kieran/packet.c), taking
+timestamps from the simulated server clock through a time source hook.
+********************************************************************************/
+
+/********************************************************************************
+INCLUDES
+********************************************************************************/
+#include <string.h>
+#include "../Kieran/packet.h"
+#include "../Kieran/timesource.h"
+#include "sim.h"
+
+/********************************************************************************
+SIM_SERVER_INIT
+Arguments: struct sim_clock *clock: the server's clock
+Returns: N/A
+********************************************************************************/
+void sim_server_init(struct sim_clock *clock){
+  time_source_hook(sim_clock_ntp, clock);
+}
+
+/********************************************************************************
+SIM_SERVER_RECEIVE
+First half of the server's child: receive timestamp and header
+
+Arguments: unsigned char *reply: SIMPACKET bytes, reply so far
+           const unsigned char *req: SIMPACKET bytes, the request
+Returns: N/A
+********************************************************************************/
+void sim_server_receive(unsigned char *reply, const unsigned char *req){
+  union Packetmagic Sent;
+  union Packetmagic Received;
+  unsigned char buffer[SIMPACKET];
+  int state = 1;
+
+  memset(&Sent.bytes, 0, sizeof(Sent.bytes));
+  memset(&Received.bytes, 0, sizeof(Received.bytes));
+  memcpy(buffer, req, sizeof(buffer));
+  local_time_finder(&Sent, &state);
+  packet_constructor(&Sent, &Received, buffer);
+  memcpy(reply, Sent.bytes, SIMPACKET);
+}
+
+/********************************************************************************
+SIM_SERVER_TRANSMIT
+Second half: transmit timestamp, just before the reply is sent
+
+Arguments: unsigned char *reply: SIMPACKET bytes, completed in place
+Returns: N/A
+********************************************************************************/
+void sim_server_transmit(unsigned char *reply){
+  union Packetmagic Sent;
+  int state = 0;
+
+  memcpy(Sent.bytes, reply, sizeof(Sent.bytes));
+  local_time_finder(&Sent, &state);
+  memcpy(reply, Sent.bytes, SIMPACKET);
+}